@@ -0,0 +1,522 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <exception>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include <vector>
+#include <wil/resource.h>
+#include <wil/com.h>
+#include <ncryptprotect.h>
+
+using unique_ncrypt_stream = wil::unique_any<NCRYPT_STREAM_HANDLE, decltype(&::NCryptStreamClose), ::NCryptStreamClose>;
+
+// Sources and sinks for CryptoStream. A source has "size_t read(std::span<uint8_t>)" returning
+// the number of bytes placed in the buffer, zero at the end. Sources over memory, or that keep
+// their own buffer, can also have "std::span<uint8_t const> next(size_t maxSize)", which hands
+// out their own memory in place and returns an empty span at the end. A sink has
+// "void write(std::span<uint8_t const>)" and throws on failure. Policies are plain types picked
+// at compile time so a pipeline between two native endpoints has no virtual calls in it; the
+// IStream policies are just one more adapter.
+
+template<typename T> concept CryptoSink = requires(T& sink, std::span<uint8_t const> data) { sink.write(data); };
+
+// Reads from a Win32 file (or pipe) handle. A pipe whose writer has closed its end reports
+// ERROR_BROKEN_PIPE rather than a zero-byte read; that is its end of stream.
+struct HandleSource
+{
+    HANDLE file;
+
+    size_t read(std::span<uint8_t> buffer)
+    {
+        DWORD readSize = 0;
+        if (!::ReadFile(file, buffer.data(), static_cast<DWORD>((std::min)(buffer.size(), size_t{ MAXDWORD })), &readSize, nullptr))
+        {
+            auto const error = ::GetLastError();
+            THROW_WIN32_IF(error, error != ERROR_BROKEN_PIPE);
+            return 0;
+        }
+        return readSize;
+    }
+};
+
+// Writes to a Win32 file (or pipe) handle.
+struct HandleSink
+{
+    HANDLE file;
+
+    void write(std::span<uint8_t const> data)
+    {
+        while (!data.empty())
+        {
+            DWORD written = 0;
+            THROW_IF_WIN32_BOOL_FALSE(::WriteFile(file, data.data(), static_cast<DWORD>((std::min)(data.size(), size_t{ MAXDWORD })), &written, nullptr));
+            data = data.subspan(written);
+        }
+    }
+};
+
+// Unbuffered (FILE_FLAG_NO_BUFFERING) handles only accept reads and writes that are whole
+// sectors, at sector-aligned offsets, from sector-aligned memory. VirtualAlloc'd buffers are page
+// aligned, which covers every sector size up to the page size.
+inline constexpr size_t c_directIoBufferSize = 1024 * 1024;
+
+inline size_t GetDirectIoSectorSize(HANDLE file)
+{
+    FILE_STORAGE_INFO storage{};
+    if (::GetFileInformationByHandleEx(file, FileStorageInfo, &storage, sizeof(storage)) && storage.PhysicalBytesPerSectorForPerformance)
+    {
+        return storage.PhysicalBytesPerSectorForPerformance;
+    }
+    return 4096;
+}
+
+inline wil::unique_virtualalloc_ptr<uint8_t> AllocateDirectIoBuffer(size_t size)
+{
+    wil::unique_virtualalloc_ptr<uint8_t> buffer{ static_cast<uint8_t*>(::VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) };
+    THROW_LAST_ERROR_IF(!buffer);
+    return buffer;
+}
+
+// Reads an unbuffered file handle in large aligned blocks and hands out pieces of its own buffer
+// in place. The last read of the file simply comes back short.
+struct DirectFileSource
+{
+    explicit DirectFileSource(HANDLE file) : m_file(file), m_buffer(AllocateDirectIoBuffer(c_directIoBufferSize))
+    {
+    }
+
+    std::span<uint8_t const> next(size_t maxSize)
+    {
+        if ((m_offset == m_available) && !m_atEnd)
+        {
+            DWORD readSize = 0;
+            THROW_IF_WIN32_BOOL_FALSE(::ReadFile(m_file, m_buffer.get(), static_cast<DWORD>(c_directIoBufferSize), &readSize, nullptr));
+            m_available = readSize;
+            m_offset = 0;
+            m_atEnd = (readSize < c_directIoBufferSize);
+        }
+
+        auto const chunk = std::span<uint8_t const>{ m_buffer.get() + m_offset, (std::min)(maxSize, m_available - m_offset) };
+        m_offset += chunk.size();
+        return chunk;
+    }
+
+    size_t read(std::span<uint8_t> buffer)
+    {
+        auto const chunk = next(buffer.size());
+        std::copy(chunk.begin(), chunk.end(), buffer.begin());
+        return chunk.size();
+    }
+
+private:
+    HANDLE m_file;
+    wil::unique_virtualalloc_ptr<uint8_t> m_buffer;
+    size_t m_available{ 0 };
+    size_t m_offset{ 0 };
+    bool m_atEnd{ false };
+};
+
+// Writes to an unbuffered, write-through file handle. Output is gathered into an aligned buffer
+// and written in large whole-sector blocks. finish() must be called at the end: it writes the
+// final partial block padded out to a whole sector, then trims the file back to its real length.
+struct DirectFileSink
+{
+    explicit DirectFileSink(HANDLE file) : m_file(file), m_sectorSize(GetDirectIoSectorSize(file)), m_buffer(AllocateDirectIoBuffer(c_directIoBufferSize))
+    {
+        THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED), (c_directIoBufferSize % m_sectorSize) != 0);
+    }
+
+    void write(std::span<uint8_t const> data)
+    {
+        while (!data.empty())
+        {
+            auto const chunk = (std::min)(data.size(), c_directIoBufferSize - m_used);
+            std::copy_n(data.begin(), chunk, m_buffer.get() + m_used);
+            data = data.subspan(chunk);
+            m_used += chunk;
+            if (m_used == c_directIoBufferSize)
+            {
+                Flush(m_used);
+            }
+        }
+    }
+
+    void finish()
+    {
+        if (m_used)
+        {
+            auto const padded = (m_used + m_sectorSize - 1) / m_sectorSize * m_sectorSize;
+            std::fill(m_buffer.get() + m_used, m_buffer.get() + padded, uint8_t{ 0 });
+            auto const realLength = m_written + m_used;
+            Flush(padded);
+            m_written = realLength;
+        }
+
+        FILE_END_OF_FILE_INFO endOfFile{};
+        endOfFile.EndOfFile.QuadPart = static_cast<LONGLONG>(m_written);
+        THROW_IF_WIN32_BOOL_FALSE(::SetFileInformationByHandle(m_file, FileEndOfFileInfo, &endOfFile, sizeof(endOfFile)));
+    }
+
+private:
+    void Flush(size_t size)
+    {
+        DWORD written = 0;
+        THROW_IF_WIN32_BOOL_FALSE(::WriteFile(m_file, m_buffer.get(), static_cast<DWORD>(size), &written, nullptr));
+        THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_WRITE_FAULT), written != size);
+        m_written += written;
+        m_used = 0;
+    }
+
+    HANDLE m_file;
+    size_t m_sectorSize;
+    wil::unique_virtualalloc_ptr<uint8_t> m_buffer;
+    size_t m_used{ 0 };
+    uint64_t m_written{ 0 };
+};
+
+// Reads from memory the caller owns. CryptoStream feeds this straight to NCrypt without
+// copying it through a read buffer first.
+struct SpanSource
+{
+    std::span<uint8_t const> data;
+
+    std::span<uint8_t const> next(size_t maxSize)
+    {
+        auto const chunk = data.first((std::min)(maxSize, data.size()));
+        data = data.subspan(chunk.size());
+        return chunk;
+    }
+
+    size_t read(std::span<uint8_t> buffer)
+    {
+        auto const chunk = next(buffer.size());
+        std::copy(chunk.begin(), chunk.end(), buffer.begin());
+        return chunk.size();
+    }
+};
+
+// Reads a list of separate caller-owned buffers (iovec-style) in order, as if they were one.
+// Like SpanSource, each buffer is handed to NCrypt in place, so building a message out of a
+// header, a body and attachments doesn't need a concatenated copy.
+struct GatherSource
+{
+    std::span<std::span<uint8_t const> const> segments;
+    size_t offset{ 0 };
+
+    std::span<uint8_t const> next(size_t maxSize)
+    {
+        while (!segments.empty() && (offset == segments.front().size()))
+        {
+            segments = segments.subspan(1);
+            offset = 0;
+        }
+
+        if (segments.empty())
+        {
+            return {};
+        }
+
+        auto const chunk = segments.front().subspan(offset, (std::min)(maxSize, segments.front().size() - offset));
+        offset += chunk.size();
+        return chunk;
+    }
+
+    size_t read(std::span<uint8_t> buffer)
+    {
+        size_t readSize = 0;
+        while (readSize < buffer.size())
+        {
+            auto const chunk = next(buffer.size() - readSize);
+            if (chunk.empty())
+            {
+                break;
+            }
+            std::copy(chunk.begin(), chunk.end(), buffer.begin() + readSize);
+            readSize += chunk.size();
+        }
+        return readSize;
+    }
+};
+
+// Writes into a fixed-size buffer the caller owns; running out of room is an error.
+struct SpanSink
+{
+    std::span<uint8_t> buffer;
+    size_t written{ 0 };
+
+    void write(std::span<uint8_t const> data)
+    {
+        THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER), data.size() > buffer.size() - written);
+        std::copy(data.begin(), data.end(), buffer.begin() + written);
+        written += data.size();
+    }
+};
+
+// Writes across a list of caller-owned buffers in order, filling each before moving on to the
+// next. Running out of room in the last one is an error.
+struct ScatterSink
+{
+    std::span<std::span<uint8_t> const> segments;
+    size_t offset{ 0 };
+    size_t written{ 0 };
+
+    void write(std::span<uint8_t const> data)
+    {
+        while (!data.empty())
+        {
+            while (!segments.empty() && (offset == segments.front().size()))
+            {
+                segments = segments.subspan(1);
+                offset = 0;
+            }
+            THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER), segments.empty());
+
+            auto const chunk = (std::min)(data.size(), segments.front().size() - offset);
+            std::copy_n(data.begin(), chunk, segments.front().begin() + offset);
+            data = data.subspan(chunk);
+            offset += chunk;
+            written += chunk;
+        }
+    }
+};
+
+// Appends to the end of a vector, growing it as needed.
+struct VectorSink
+{
+    std::vector<uint8_t>& output;
+
+    void write(std::span<uint8_t const> data)
+    {
+        output.insert(output.end(), data.begin(), data.end());
+    }
+};
+
+// Counts and drops everything written to it, for when only success of the operation matters.
+struct DiscardSink
+{
+    uint64_t written{ 0 };
+
+    void write(std::span<uint8_t const> data)
+    {
+        written += data.size();
+    }
+};
+
+// Hands each chunk to a callable; the callable can throw to abort the operation.
+template<typename Callback> struct CallbackSink
+{
+    Callback callback;
+
+    void write(std::span<uint8_t const> data)
+    {
+        callback(data);
+    }
+};
+
+template<typename Callback> CallbackSink(Callback) -> CallbackSink<Callback>;
+
+// Reads from an IStream.
+struct StreamSource
+{
+    IStream* stream;
+
+    size_t read(std::span<uint8_t> buffer)
+    {
+        return wil::stream_read_partial(stream, buffer.data(), static_cast<unsigned long>((std::min)(buffer.size(), size_t{ ULONG_MAX })));
+    }
+};
+
+// Writes to an IStream.
+struct StreamSink
+{
+    IStream* stream;
+
+    void write(std::span<uint8_t const> data)
+    {
+        while (!data.empty())
+        {
+            auto const chunk = static_cast<unsigned long>((std::min)(data.size(), size_t{ ULONG_MAX }));
+            wil::stream_write(stream, data.data(), chunk);
+            data = data.subspan(chunk);
+        }
+    }
+};
+
+// The streaming protect/unprotect core. Bytes pushed in with update() come out the other side
+// into the sink, which is called directly from the NCrypt output callback. Exceptions thrown by
+// the sink can't cross the NCrypt callback, so they're held and rethrown from update() or
+// finish(). The object holds its own address in the NCrypt stream, so it can't be moved; use
+// std::optional::emplace to hold one as a member.
+template<typename Sink> struct CryptoStream
+{
+    // Opens a stream that protects content with the given descriptor.
+    CryptoStream(NCRYPT_DESCRIPTOR_HANDLE descriptor, Sink& sink, DWORD flags = 0) : m_sink(sink)
+    {
+        ConfigureStreamInfo();
+        THROW_IF_WIN32_ERROR(::NCryptStreamOpenToProtect(descriptor, flags, nullptr, &m_streamInfo, m_handle.put()));
+    }
+
+    // Opens a stream that unprotects content; the descriptor comes from the content itself.
+    explicit CryptoStream(Sink& sink, DWORD flags = 0) : m_sink(sink)
+    {
+        ConfigureStreamInfo();
+        THROW_IF_WIN32_ERROR(::NCryptStreamOpenToUnprotect(&m_streamInfo, flags, nullptr, m_handle.put()));
+    }
+
+    CryptoStream(CryptoStream const&) = delete;
+    CryptoStream& operator=(CryptoStream const&) = delete;
+
+    void update(std::span<uint8_t const> data)
+    {
+        THROW_HR_IF(E_ILLEGAL_METHOD_CALL, !m_handle);
+        Check(::NCryptStreamUpdate(m_handle.get(), data.data(), data.size(), FALSE));
+        m_consumed += data.size();
+    }
+
+    // Number of bytes accepted by update() so far.
+    uint64_t consumed() const { return m_consumed; }
+
+    // Flushes the final block through to the sink. Calling it again does nothing.
+    void finish()
+    {
+        if (m_handle)
+        {
+            auto handle = std::move(m_handle);
+            Check(::NCryptStreamUpdate(handle.get(), nullptr, 0, TRUE));
+        }
+    }
+
+private:
+    void ConfigureStreamInfo()
+    {
+        m_streamInfo.pvCallbackCtxt = this;
+        m_streamInfo.pfnStreamOutput = &CryptoStream::OnOutput;
+    }
+
+    void Check(SECURITY_STATUS status)
+    {
+        if (m_sinkError)
+        {
+            std::rethrow_exception(std::exchange(m_sinkError, {}));
+        }
+        THROW_IF_WIN32_ERROR(status);
+    }
+
+    static SECURITY_STATUS WINAPI OnOutput(void* context, BYTE const* data, SIZE_T size, BOOL) noexcept
+    {
+        auto self = static_cast<CryptoStream*>(context);
+        try
+        {
+            self->m_sink.write({ data, size });
+            return ERROR_SUCCESS;
+        }
+        catch (...)
+        {
+            self->m_sinkError = std::current_exception();
+            return ERROR_WRITE_FAULT;
+        }
+    }
+
+    Sink& m_sink;
+    std::exception_ptr m_sinkError;
+    NCRYPT_PROTECT_STREAM_INFO m_streamInfo{};
+    unique_ncrypt_stream m_handle;
+    uint64_t m_consumed{ 0 };
+};
+
+// Feeds everything written to it into another CryptoStream, so one stream's output becomes the
+// next one's input with nothing buffered in between. Finishing the downstream stream is up to
+// the caller, once the upstream one has finished.
+template<typename Sink> struct ChainedSink
+{
+    CryptoStream<Sink>& next;
+    uint64_t written{ 0 };
+
+    void write(std::span<uint8_t const> data)
+    {
+        next.update(data);
+        written += data.size();
+    }
+};
+
+template<typename Sink> ChainedSink(CryptoStream<Sink>&) -> ChainedSink<Sink>;
+
+// Passes everything through to another sink, keeping a running FNV-1a checksum of it. That is
+// enough to tell whether bytes on disk are still the ones that were written, not to detect
+// deliberate tampering.
+template<typename Sink> struct ChecksumSink
+{
+    static constexpr uint64_t c_offsetBasis = 0xcbf29ce484222325;
+    static constexpr uint64_t c_prime = 0x100000001b3;
+
+    Sink& next;
+    uint64_t checksum{ c_offsetBasis };
+    uint64_t written{ 0 };
+
+    void write(std::span<uint8_t const> data)
+    {
+        for (auto const value : data)
+        {
+            checksum = (checksum ^ value) * c_prime;
+        }
+        next.write(data);
+        written += data.size();
+    }
+};
+
+template<typename Sink> ChecksumSink(Sink&) -> ChecksumSink<Sink>;
+
+// Size of the chunks pulled from a source and pushed through a CryptoStream.
+inline constexpr size_t c_cryptoStreamChunkSize = 64 * 1024;
+
+// Pulls everything out of the source and pushes it through the stream, leaving the stream open
+// for more.
+template<typename Source, typename Sink> void FeedCryptoStream(Source& source, CryptoStream<Sink>& stream)
+{
+    if constexpr (requires { source.next(c_cryptoStreamChunkSize); })
+    {
+        // Already in memory - hand it over in place rather than copying it through another buffer.
+        while (true)
+        {
+            auto const chunk = source.next(c_cryptoStreamChunkSize);
+            if (chunk.empty())
+            {
+                break;
+            }
+            stream.update(chunk);
+        }
+    }
+    else
+    {
+        auto buffer = std::make_unique<std::array<uint8_t, c_cryptoStreamChunkSize>>();
+        while (auto const readSize = source.read(*buffer))
+        {
+            stream.update(std::span{ *buffer }.first(readSize));
+        }
+    }
+}
+
+// Pulls everything out of the source, pushes it through the stream, and finishes the stream.
+template<typename Source, typename Sink> void PumpCryptoStream(Source& source, CryptoStream<Sink>& stream)
+{
+    FeedCryptoStream(source, stream);
+    stream.finish();
+}
+
+// Protects everything in the source with the descriptor and writes the result to the sink.
+template<typename Source, typename Sink> void ProtectToSink(NCRYPT_DESCRIPTOR_HANDLE descriptor, Source&& source, Sink&& sink, DWORD flags = NCRYPT_SILENT_FLAG)
+{
+    CryptoStream<std::remove_reference_t<Sink>> stream{ descriptor, sink, flags };
+    PumpCryptoStream(source, stream);
+}
+
+// Unprotects everything in the source and writes the cleartext to the sink. Without
+// NCRYPT_SILENT_FLAG, scopes that need it may prompt the user; unattended callers should pass it.
+template<typename Source, typename Sink> void UnprotectToSink(Source&& source, Sink&& sink, DWORD flags = 0)
+{
+    CryptoStream<std::remove_reference_t<Sink>> stream{ sink, flags };
+    PumpCryptoStream(source, stream);
+}
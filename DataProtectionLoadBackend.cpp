@@ -0,0 +1,46 @@
+#include "pch.h"
+#include "DataProtectionProvider.h"
+#include "LoadGenerator.h"
+
+namespace
+{
+    struct DataProtectionLoadBackend : LoadBackend
+    {
+        DataProtectionLoadBackend(std::wstring const& scope) : m_provider(scope), m_name("ncrypt:" + winrt::to_string(scope))
+        {
+        }
+
+        std::string name() const override
+        {
+            return m_name;
+        }
+
+        std::vector<uint8_t> protect(std::span<uint8_t const> data) override
+        {
+            auto const protectedData = m_provider.ProtectBuffer(data);
+            auto const bytes = protectedData.as_span<uint8_t>();
+            return { bytes.begin(), bytes.end() };
+        }
+
+        void unprotect(std::span<uint8_t const> protectedData) override
+        {
+            m_provider.UnprotectBuffer(protectedData);
+        }
+
+        void openCloseStream() override
+        {
+            DiscardSink sink;
+            CryptoStream stream{ m_provider.descriptor(), sink, NCRYPT_SILENT_FLAG };
+            stream.finish();
+        }
+
+    private:
+        DataProtectionProvider m_provider;
+        std::string m_name;
+    };
+}
+
+std::unique_ptr<LoadBackend> CreateDataProtectionLoadBackend(std::wstring const& scope)
+{
+    return std::make_unique<DataProtectionLoadBackend>(scope);
+}
@@ -1,7 +1,8 @@
 #include "pch.h"
 #include "DataProtectionProvider.h"
 
-DataProtectionProvider::DataProtectionProvider(std::wstring const& scope)
+DataProtectionProvider::DataProtectionProvider(std::wstring const& scope) :
+    m_scope(scope)
 {
     THROW_IF_WIN32_ERROR(::NCryptCreateProtectionDescriptor(
         scope.c_str(),
@@ -9,7 +10,7 @@ DataProtectionProvider::DataProtectionProvider(std::wstring const& scope)
         &m_descriptor));
 }
 
-DataProtectionBuffer DataProtectionProvider::ProtectBuffer(std::span<uint8_t const> data)
+DataProtectionBuffer DataProtectionProvider::ProtectBuffer(std::span<uint8_t const> data) const
 {
     wil::unique_hlocal_ptr<> protectedData;
     ULONG protectedSize = 0;
@@ -53,6 +54,11 @@ winrt::com_ptr<DataProtectionStreamWriter> DataProtectionProvider::CreateDecrypt
     return winrt::make_self<DataProtectionStreamWriter>(outputStream);
 }
 
+std::unique_ptr<ProtectedLogWriter> DataProtectionProvider::CreateLogWriter(std::filesystem::path const& path, ProtectedLogOptions const& options)
+{
+    return std::make_unique<ProtectedLogWriter>(m_descriptor, path, options);
+}
+
 DataProtectionProvider::~DataProtectionProvider()
 {
     if (m_descriptor)
@@ -61,46 +67,34 @@ DataProtectionProvider::~DataProtectionProvider()
     }
 }
 
-DataProtectionStreamWriter::DataProtectionStreamWriter(NCRYPT_DESCRIPTOR_HANDLE encryptionDescriptor, IStream* lower)
+DataProtectionStreamWriter::DataProtectionStreamWriter(NCRYPT_DESCRIPTOR_HANDLE encryptionDescriptor, IStream* lower) : m_lower(lower), m_sink{ lower }
 {
-    ConfigureStreamInfo(lower);
-    THROW_IF_WIN32_ERROR(::NCryptStreamOpenToProtect(encryptionDescriptor, 0, nullptr, &m_streamInfo, &m_handle));
+    m_stream.emplace(encryptionDescriptor, m_sink);
 }
 
-DataProtectionStreamWriter::DataProtectionStreamWriter(IStream* lower)
+DataProtectionStreamWriter::DataProtectionStreamWriter(IStream* lower) : m_lower(lower), m_sink{ lower }
 {
-    ConfigureStreamInfo(lower);
-    THROW_IF_WIN32_ERROR(::NCryptStreamOpenToUnprotect(&m_streamInfo, 0, nullptr, &m_handle));
+    m_stream.emplace(m_sink);
 }
 
-void DataProtectionStreamWriter::ConfigureStreamInfo(IStream* lower)
+void DataProtectionStreamWriter::finish()
 {
-    m_lower = lower;
-    m_streamInfo.pvCallbackCtxt = this;
-    m_streamInfo.pfnStreamOutput = [](void* context, BYTE const* data, SIZE_T size, BOOL) -> SECURITY_STATUS
-        {
-            auto self = static_cast<DataProtectionStreamWriter*>(context);
-            RETURN_IF_FAILED(self->m_writeError = wil::stream_write_nothrow(self->m_lower.get(), data, static_cast<ULONG>(size)));
-            return 0;
-        };
+    m_stream->finish();
 }
 
-void DataProtectionStreamWriter::finish()
+void DataProtectionStreamWriter::writeGather(std::span<std::span<uint8_t const> const> segments)
 {
-    if (auto h = std::exchange(m_handle, {}))
-    {
-        THROW_IF_WIN32_ERROR(::NCryptStreamUpdate(h, nullptr, 0, TRUE));
-        THROW_IF_WIN32_ERROR(::NCryptStreamClose(h));
-    }
+    GatherSource source{ segments };
+    FeedCryptoStream(source, *m_stream);
 }
 
-STDMETHODIMP DataProtectionStreamWriter::Write(void const* pv, ULONG size, ULONG* pcbWritten) noexcept
+STDMETHODIMP DataProtectionStreamWriter::Write(void const* pv, ULONG size, ULONG* pcbWritten) noexcept try
 {
-    RETURN_HR_IF(E_UNEXPECTED, !m_handle);
-    RETURN_IF_WIN32_ERROR(::NCryptStreamUpdate(m_handle, reinterpret_cast<BYTE const*>(pv), size, FALSE));
+    m_stream->update({ reinterpret_cast<uint8_t const*>(pv), size });
     wil::assign_to_opt_param(pcbWritten, size);
     return S_OK;
 }
+CATCH_RETURN();
 
 STDMETHODIMP DataProtectionStreamWriter::Read(void*, ULONG, ULONG* read) noexcept
 {
@@ -3,10 +3,20 @@
 #include <Unknwn.h>
 #include <string>
 #include <span>
+#include <array>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <filesystem>
+#include <memory>
+#include <optional>
 #include <wil/resource.h>
 #include <wil/com.h>
 #include <winrt/base.h>
 #include <ncryptprotect.h>
+#include "CryptoStream.h"
 
 struct DataProtectionBuffer
 {
@@ -42,6 +52,10 @@ struct DataProtectionStreamWriter : winrt::implements<DataProtectionStreamWriter
     DataProtectionStreamWriter(IStream* lower);
     void finish();
 
+    // Pushes each of the segments through the filter in order, as if they were one contiguous
+    // Write, without copying them together first.
+    void writeGather(std::span<std::span<uint8_t const> const> segments);
+
 protected:
     STDMETHODIMP Write(void const* pv, ULONG size, ULONG* pcbWritten) noexcept override;
     STDMETHODIMP Read(void*, ULONG, ULONG* read) noexcept override;
@@ -56,11 +70,91 @@ protected:
     STDMETHODIMP UnlockRegion(ULARGE_INTEGER, ULARGE_INTEGER, DWORD) noexcept override;
 
 private:
-    void ConfigureStreamInfo(IStream* lower);
     wil::com_ptr<::IStream> m_lower{ nullptr };
-    HRESULT m_writeError{ S_OK };
-    NCRYPT_STREAM_HANDLE m_handle{ nullptr };
-    NCRYPT_PROTECT_STREAM_INFO m_streamInfo{};
+    StreamSink m_sink{ nullptr };
+    std::optional<CryptoStream<StreamSink>> m_stream;
+};
+
+// Each segment of a protected log is framed by this header, followed by ciphertextSize bytes
+// produced by NCryptStreamOpenToProtect. Every segment is a complete protected stream, so it
+// can be decrypted without any of the segments before or after it.
+struct ProtectedLogSegmentHeader
+{
+    static constexpr uint32_t c_magic = 0x474C5044; // "DPLG"
+    static constexpr uint32_t c_version = 1;
+
+    uint32_t magic{ c_magic };
+    uint32_t version{ c_version };
+    uint64_t sequence{};
+    uint64_t plaintextSize{};
+    uint64_t ciphertextSize{};
+};
+
+struct ProtectedLogOptions
+{
+    // Seal the current segment once this many cleartext bytes have been appended to it.
+    uint64_t segmentBytes{ 1024 * 1024 };
+
+    // Seal the current segment once it has been open this long, even if it is small. Zero
+    // disables time-based sealing.
+    std::chrono::milliseconds segmentInterval{ 1000 };
+
+    // When set, sealing a segment (by size or by time) also flushes it to disk. Otherwise only
+    // commit() makes sealed segments durable.
+    bool flushOnSeal{ false };
+};
+
+// Append-only encrypted log. Cleartext appended to the writer is accumulated into a segment,
+// and when the segment is sealed its ciphertext is written to the end of the file in one
+// write. A crash loses at most the unsealed segment; everything before it stays readable.
+// Reopening an existing log discards any torn segment at the tail and continues after it. The
+// last segment is only kept if it decrypts, so whoever reopens a log must be able to unprotect
+// it; a failure that isn't about the segment's content, such as having no access to its scope,
+// fails the open rather than discarding the segment. Damage anywhere before the tail fails the
+// open with ERROR_INVALID_DATA.
+//
+// Multiple threads may append and commit concurrently. Callers of commit() that arrive while
+// another thread is flushing share the next flush rather than each issuing their own.
+struct ProtectedLogWriter
+{
+    ProtectedLogWriter(NCRYPT_DESCRIPTOR_HANDLE descriptor, std::filesystem::path const& path, ProtectedLogOptions const& options = {});
+    ProtectedLogWriter(ProtectedLogWriter const&) = delete;
+    ProtectedLogWriter& operator=(ProtectedLogWriter const&) = delete;
+    ~ProtectedLogWriter();
+
+    // Adds cleartext to the current segment, sealing it if it has reached the size limit.
+    // Returns the sequence number of the segment holding the data.
+    uint64_t append(std::span<uint8_t const> data);
+
+    // Seals the current segment (if it has any data) and returns once every sealed segment
+    // is durable on disk.
+    void commit();
+
+    // Commits any pending data and closes the file.
+    void close();
+
+private:
+    void OpenExisting();
+    void SealSegment();
+    void OnTimer() noexcept;
+
+    NCRYPT_DESCRIPTOR_HANDLE m_descriptor{ nullptr };
+    ProtectedLogOptions m_options;
+    wil::unique_hfile m_file;
+
+    std::mutex m_lock;
+    std::condition_variable m_flushed;
+    std::vector<uint8_t> m_segmentFrame;
+    VectorSink m_segmentSink{ m_segmentFrame };
+    std::optional<CryptoStream<VectorSink>> m_segment;
+    std::chrono::steady_clock::time_point m_segmentStart{};
+    uint64_t m_segmentPlaintextSize{ 0 };
+    uint64_t m_nextSequence{ 0 };      // also the count of segments written to the file
+    uint64_t m_segmentsDurable{ 0 };
+    bool m_flushing{ false };
+
+    // Declared last so it is torn down (and its callbacks drained) before anything it touches.
+    wil::unique_threadpool_timer m_timer;
 };
 
 struct DataProtectionProvider
@@ -69,7 +163,7 @@ struct DataProtectionProvider
 
     // Takes a buffer of cleartext data and returns an ecrypted buffer of data based on the protection
     // scope specified in the constructor.
-    DataProtectionBuffer ProtectBuffer(std::span<uint8_t const> data);
+    DataProtectionBuffer ProtectBuffer(std::span<uint8_t const> data) const;
 
     // Takes a buffer of encrypted data and returns a cleartext buffer after decrypting it. Note that
     // protected buffers include their decryption scope. No error occurs if you attempt to decrypt a
@@ -92,10 +186,40 @@ struct DataProtectionProvider
     // the stream or seek it will fail.
     winrt::com_ptr<DataProtectionStreamWriter> CreateDecryptionStreamWriter(::IStream* outputStream);
 
+    // Protects the concatenation of 'segments' into 'sink' without building a contiguous copy of
+    // them first. The output is in the stream format (see Compatibility in the readme), so
+    // unprotect it with a decryption stream or UnprotectScatter, not UnprotectBuffer.
+    template<typename Sink> void ProtectGather(std::span<std::span<uint8_t const> const> segments, Sink&& sink)
+    {
+        ProtectToSink(m_descriptor, GatherSource{ segments }, sink);
+    }
+
+    // Unprotects stream-format content from 'source' and scatters the cleartext across 'segments'
+    // in order, filling each one before moving to the next. Returns the number of cleartext bytes
+    // written. Fails with ERROR_INSUFFICIENT_BUFFER if the segments are too small to hold it all.
+    template<typename Source> size_t UnprotectScatter(Source&& source, std::span<std::span<uint8_t> const> segments)
+    {
+        ScatterSink sink{ segments };
+        UnprotectToSink(source, sink);
+        return sink.written;
+    }
+
+    // Opens (or creates) an append-only protected log at 'path'. Segments are protected with
+    // the scope specified in the constructor; the provider must outlive the writer.
+    std::unique_ptr<ProtectedLogWriter> CreateLogWriter(std::filesystem::path const& path, ProtectedLogOptions const& options = {});
+
+    // The protection descriptor for the scope specified in the constructor, for use with
+    // CryptoStream and ProtectToSink. Owned by the provider.
+    NCRYPT_DESCRIPTOR_HANDLE descriptor() const { return m_descriptor; }
+
+    // The scope specified in the constructor.
+    std::wstring const& scope() const { return m_scope; }
+
     ~DataProtectionProvider();
 
 private:
     NCRYPT_DESCRIPTOR_HANDLE m_descriptor{ nullptr };
+    std::wstring m_scope;
 };
 
 // Given an encrypted stream, this type will decrypt it on the fly as it is read. Note that
@@ -106,7 +230,6 @@ struct DecryptionReadStream : winrt::implements<DecryptionReadStream, IStream, I
 public:
 
     DecryptionReadStream(IStream* encryptedSource);
-    ~DecryptionReadStream();
 
 protected:
 
@@ -127,9 +250,130 @@ private:
 
     bool m_finalBlockRead{ false };
     std::vector<uint8_t> m_pendingData;
+    VectorSink m_pendingSink{ m_pendingData };
     wil::com_ptr<IStream> m_source;
-    NCRYPT_STREAM_HANDLE m_streamHandle{ nullptr };
-    NCRYPT_PROTECT_STREAM_INFO m_streamInfo{};
+    CryptoStream<VectorSink> m_stream{ m_pendingSink };
     uint64_t m_dataReadSoFar{ 0 };
     std::array<uint8_t, 64 * 1024> m_sourceReadBuffer{};
 };
+
+// Tails a log produced by ProtectedLogWriter. Each call to readNewSegments picks up where the
+// previous one stopped, so a reader can poll a log that is still being written. A segment
+// that has only been partially written is left for a later call; any other failure to decrypt
+// it, including having no access to its scope, is thrown.
+struct ProtectedLogReader
+{
+    ProtectedLogReader(std::filesystem::path const& path);
+
+    // Decrypts every complete segment appended since the last call and hands its cleartext to
+    // the callback, in order. Returns the number of segments delivered.
+    size_t readNewSegments(std::function<void(uint64_t sequence, std::span<uint8_t const> cleartext)> const& onSegment);
+
+    // Offset in the file just past the last segment delivered.
+    uint64_t position() const { return m_offset; }
+
+private:
+    wil::unique_hfile m_file;
+    uint64_t m_offset{ 0 };
+    std::vector<uint8_t> m_ciphertext;
+    std::vector<uint8_t> m_cleartext;
+};
+
+// How the protected-file helpers do their file I/O. Buffered goes through the system file cache
+// as usual. Direct opens the file unbuffered (and write-through, when writing) and moves data in
+// large sector-aligned blocks, so bulk jobs over files nobody will read again soon don't push
+// other processes' data out of the cache.
+enum class FileIoMode
+{
+    Buffered,
+    Direct,
+};
+
+// Opens a protected file for sequential reading. Read a Buffered handle with HandleSource and a
+// Direct one with DirectFileSource; an unbuffered handle rejects HandleSource's unaligned reads.
+wil::unique_hfile OpenProtectedFileForRead(std::filesystem::path const& path, FileIoMode mode = FileIoMode::Buffered);
+
+// Decrypts a stream-format protected file into 'sink', one read chunk at a time. The sink sees
+// the first cleartext as soon as the first chunk is decrypted, and a sink that blocks holds up
+// further reads from the file, so memory use stays at one chunk regardless of file size.
+// Returns the number of cleartext bytes produced.
+template<CryptoSink Sink> uint64_t DecryptFileToSink(std::filesystem::path const& path, Sink&& sink, FileIoMode mode = FileIoMode::Buffered)
+{
+    auto file = OpenProtectedFileForRead(path, mode);
+    uint64_t written = 0;
+    CallbackSink counter{ [&](std::span<uint8_t const> data) {
+        sink.write(data);
+        written += data.size();
+    } };
+    if (mode == FileIoMode::Direct)
+    {
+        UnprotectToSink(DirectFileSource{ file.get() }, counter);
+    }
+    else
+    {
+        UnprotectToSink(HandleSource{ file.get() }, counter);
+    }
+    return written;
+}
+
+// DecryptFileToSink for the common endpoints: an IStream, a file or pipe handle, or a callback.
+uint64_t DecryptFileToSink(std::filesystem::path const& path, IStream* output, FileIoMode mode = FileIoMode::Buffered);
+uint64_t DecryptFileToSink(std::filesystem::path const& path, HANDLE output, FileIoMode mode = FileIoMode::Buffered);
+uint64_t DecryptFileToSink(std::filesystem::path const& path, std::function<void(std::span<uint8_t const>)> const& output, FileIoMode mode = FileIoMode::Buffered);
+
+// Protects everything read from 'source' with the given scope into a new file at 'path',
+// replacing any existing file, and records its ProtectedFileMetadata in a sidecar next to it.
+void EncryptStreamToFile(IStream* source, std::filesystem::path const& path, std::wstring const& cryptDescriptor, FileIoMode mode = FileIoMode::Buffered);
+
+// Protects 'data' in a single ProtectBuffer call into a new file at 'path', which must not already
+// exist, and records its ProtectedFileMetadata in a sidecar next to it. The file is in the buffer
+// format, so it reads back with UnprotectBuffer rather than DecryptFileToSink.
+void ProtectBufferToFile(std::span<uint8_t const> data, std::filesystem::path const& path, DataProtectionProvider& provider);
+
+// Reads a whole buffer-format protected file, such as ProtectBufferToFile writes, and unprotects it
+// in one NCryptUnprotectSecret call; the format can't be decrypted piecewise, so the file and its
+// cleartext are both held in memory. Unattended callers should pass NCRYPT_SILENT_FLAG.
+DataProtectionBuffer UnprotectFileToBuffer(std::filesystem::path const& path, DWORD flags = 0);
+
+// Decrypts a whole protected file into a new memory stream, positioned at the start. This holds
+// the entire cleartext in memory; prefer DecryptFileToSink for anything large.
+winrt::com_ptr<IStream> DecryptFileToStream(std::filesystem::path const& path, FileIoMode mode = FileIoMode::Buffered);
+
+// Which of the two incompatible protected formats a file holds (see Compatibility in the readme).
+enum class ProtectedFormat : uint32_t
+{
+    Unknown = 0,
+    Buffer = 1, // NCryptProtectSecret / ProtectBuffer
+    Stream = 2, // NCryptStreamOpenToProtect / CryptoStream
+};
+
+// What is known about a protected file without decrypting it. It's kept in a small sidecar file
+// next to the protected file, named by appending c_protectedMetadataSuffix. The file helpers
+// write one for every file they produce.
+struct ProtectedFileMetadata
+{
+    ProtectedFormat format{ ProtectedFormat::Unknown };
+    std::wstring scope;
+    uint64_t plaintextSize{ 0 };
+    uint64_t ciphertextSize{ 0 };
+
+    // FNV-1a of the ciphertext (see ChecksumSink).
+    uint64_t checksum{ 0 };
+
+    // The protected file's last-write time (a FILETIME) when the sidecar was written. If the file
+    // no longer has this time and ciphertextSize, the sidecar describes an older version of it.
+    uint64_t lastWriteTime{ 0 };
+};
+
+inline constexpr wchar_t c_protectedMetadataSuffix[] = L".dpmeta";
+
+// Writes the sidecar for the protected file at 'path', which must already be complete and closed;
+// its current last-write time is recorded in place of metadata.lastWriteTime.
+void WriteProtectedFileMetadata(std::filesystem::path const& path, ProtectedFileMetadata metadata);
+
+// Removes the sidecar for the protected file at 'path', if it has one.
+void DeleteProtectedFileMetadata(std::filesystem::path const& path);
+
+// Reads the sidecar for the protected file at 'path'. Returns nothing if there isn't one, and
+// fails with ERROR_INVALID_DATA if it is damaged.
+std::optional<ProtectedFileMetadata> ReadProtectedFileMetadata(std::filesystem::path const& path);
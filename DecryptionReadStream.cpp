@@ -3,20 +3,6 @@
 
 DecryptionReadStream::DecryptionReadStream(IStream* encryptedSource) : m_source(encryptedSource)
 {
-    m_streamInfo.pvCallbackCtxt = this;
-    m_streamInfo.pfnStreamOutput = [](void* context, BYTE const* data, SIZE_T size, BOOL) -> SECURITY_STATUS
-        {
-            auto self = static_cast<DecryptionReadStream*>(context);
-            self->m_pendingData.insert(self->m_pendingData.end(), data, data + size);
-            return 0;
-        };
-
-    THROW_IF_WIN32_ERROR(::NCryptStreamOpenToUnprotect(&m_streamInfo, 0, nullptr, &m_streamHandle));
-}
-
-DecryptionReadStream::~DecryptionReadStream()
-{
-    ::NCryptStreamClose(m_streamHandle);
 }
 
 STDMETHODIMP DecryptionReadStream::Read(void* pv, ULONG size, ULONG* read) noexcept try
@@ -52,13 +38,13 @@ void DecryptionReadStream::EnsureAvailableBytes(size_t desiredSize)
             break;
         }
 
-        // Pass the chunk through the transmute stream, which calls us back with write
-        THROW_IF_WIN32_ERROR(::NCryptStreamUpdate(m_streamHandle, m_sourceReadBuffer.data(), readSize, FALSE));
+        // Pass the chunk through the transmute stream, which appends to m_pendingData
+        m_stream.update(std::span{ m_sourceReadBuffer }.first(readSize));
     }
 
     if (m_finalBlockRead)
     {
-        THROW_IF_WIN32_ERROR(::NCryptStreamUpdate(m_streamHandle, nullptr, 0, TRUE));
+        m_stream.finish();
     }
 }
 
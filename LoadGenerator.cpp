@@ -0,0 +1,482 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstdlib>
+#include <exception>
+#include <latch>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include "LoadGenerator.h"
+
+// This file sticks to the standard library, and doesn't use the precompiled header, so the
+// harness and the stand-in backend build on other platforms as-is (see portable/). The NCrypt
+// backend lives in DataProtectionLoadBackend.cpp.
+
+LatencyHistogram::LatencyHistogram() : m_counts((64 - c_subBucketBits + 1) << c_subBucketBits)
+{
+}
+
+// Values below 2^c_subBucketBits get a bucket each. Above that, each power of two is split into
+// 2^c_subBucketBits equal buckets, so a bucket is never wider than 1/128th of the values in it.
+size_t LatencyHistogram::IndexOf(uint64_t value)
+{
+    if (value < (uint64_t{ 1 } << c_subBucketBits))
+    {
+        return static_cast<size_t>(value);
+    }
+
+    auto const shift = static_cast<unsigned>(std::bit_width(value)) - 1 - c_subBucketBits;
+    return (static_cast<size_t>(shift) << c_subBucketBits) + static_cast<size_t>(value >> shift);
+}
+
+uint64_t LatencyHistogram::HighestValueAt(size_t index)
+{
+    if (index < (size_t{ 1 } << c_subBucketBits))
+    {
+        return index;
+    }
+
+    auto const shift = static_cast<unsigned>(index >> c_subBucketBits) - 1;
+    auto const subBucket = static_cast<uint64_t>(index - (static_cast<size_t>(shift) << c_subBucketBits));
+    return ((subBucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t value)
+{
+    ++m_counts[IndexOf(value)];
+    ++m_count;
+    m_sum += value;
+    m_min = (std::min)(m_min, value);
+    m_max = (std::max)(m_max, value);
+}
+
+void LatencyHistogram::merge(LatencyHistogram const& other)
+{
+    for (size_t i = 0; i < m_counts.size(); ++i)
+    {
+        m_counts[i] += other.m_counts[i];
+    }
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+    m_min = (std::min)(m_min, other.m_min);
+    m_max = (std::max)(m_max, other.m_max);
+}
+
+uint64_t LatencyHistogram::valueAtPercentile(double percentile) const
+{
+    if (m_count == 0)
+    {
+        return 0;
+    }
+
+    auto const target = (std::max)(uint64_t{ 1 }, static_cast<uint64_t>(std::ceil(percentile / 100.0 * m_count)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < m_counts.size(); ++i)
+    {
+        seen += m_counts[i];
+        if (seen >= target)
+        {
+            return (std::min)(HighestValueAt(i), m_max);
+        }
+    }
+    return m_max;
+}
+
+namespace
+{
+    struct StandInLoadBackend : LoadBackend
+    {
+        // Rough size of the header a real protected buffer carries.
+        static constexpr size_t c_headerSize = 64;
+
+        std::string name() const override
+        {
+            return "stand-in";
+        }
+
+        std::vector<uint8_t> protect(std::span<uint8_t const> data) override
+        {
+            std::vector<uint8_t> result(c_headerSize + data.size());
+            std::transform(data.begin(), data.end(), result.begin() + c_headerSize, [](uint8_t b) { return static_cast<uint8_t>(b ^ 0x5a); });
+            return result;
+        }
+
+        void unprotect(std::span<uint8_t const> protectedData) override
+        {
+            if (protectedData.size() < c_headerSize)
+            {
+                throw std::invalid_argument("stand-in protected data is too short");
+            }
+
+            std::vector<uint8_t> cleartext(protectedData.size() - c_headerSize);
+            std::transform(protectedData.begin() + c_headerSize, protectedData.end(), cleartext.begin(), [](uint8_t b) { return static_cast<uint8_t>(b ^ 0x5a); });
+            m_checksum.fetch_add(cleartext.empty() ? 0 : cleartext.back(), std::memory_order_relaxed);
+        }
+
+        void openCloseStream() override
+        {
+            auto state = std::make_unique<std::array<uint8_t, 256>>();
+            m_checksum.fetch_add(reinterpret_cast<uintptr_t>(state.get()) & 0xff, std::memory_order_relaxed);
+        }
+
+    private:
+        // Keeps the compiler from discarding work whose results are otherwise unused.
+        std::atomic<uint64_t> m_checksum{ 0 };
+    };
+
+    struct WorkerResult
+    {
+        LatencyHistogram histogram;
+        uint64_t completed{ 0 };
+        uint64_t errors{ 0 };
+        std::exception_ptr setupError;
+    };
+
+    size_t SamplePayloadSize(PayloadDistribution const& payload, std::mt19937_64& random)
+    {
+        switch (payload.kind)
+        {
+        case PayloadDistribution::Kind::Uniform:
+            return std::uniform_int_distribution<size_t>(payload.minSize, payload.maxSize)(random);
+
+        case PayloadDistribution::Kind::LogNormal:
+        {
+            auto const sample = std::lognormal_distribution<double>(std::log(static_cast<double>(payload.size)), payload.sigma)(random);
+            return std::clamp(static_cast<size_t>(std::llround(sample)), payload.minSize, payload.maxSize);
+        }
+
+        default:
+            return payload.size;
+        }
+    }
+
+    // Thread sleeps are only good to a millisecond or so, which would swamp the latencies being
+    // measured; sleep most of the way and spin the rest.
+    void WaitUntil(std::chrono::steady_clock::time_point deadline)
+    {
+        constexpr auto c_spinWindow = std::chrono::milliseconds{ 2 };
+        if (deadline - std::chrono::steady_clock::now() > c_spinWindow)
+        {
+            std::this_thread::sleep_until(deadline - c_spinWindow);
+        }
+        while (std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    char const* OperationName(LoadOperation operation)
+    {
+        switch (operation)
+        {
+        case LoadOperation::Unprotect: return "unprotect";
+        case LoadOperation::StreamOpenClose: return "stream-open-close";
+        default: return "protect";
+        }
+    }
+
+    char const* PayloadKindName(PayloadDistribution::Kind kind)
+    {
+        switch (kind)
+        {
+        case PayloadDistribution::Kind::Uniform: return "uniform";
+        case PayloadDistribution::Kind::LogNormal: return "lognormal";
+        default: return "fixed";
+        }
+    }
+
+    // Writes 'value' as a quoted JSON string. The backend name carries the user's --scope, which
+    // can hold quotes and backslashes.
+    void WriteJsonString(std::ostream& out, std::string_view value)
+    {
+        constexpr char c_hexDigits[] = "0123456789abcdef";
+        out << '"';
+        for (auto const c : value)
+        {
+            switch (c)
+            {
+            case '"': out << "\\\""; break;
+            case '\\': out << "\\\\"; break;
+            case '\n': out << "\\n"; break;
+            case '\r': out << "\\r"; break;
+            case '\t': out << "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    out << "\\u00" << c_hexDigits[c >> 4] << c_hexDigits[c & 0xf];
+                }
+                else
+                {
+                    out << c;
+                }
+                break;
+            }
+        }
+        out << '"';
+    }
+}
+
+bool PayloadDistribution::isValid() const
+{
+    switch (kind)
+    {
+    case Kind::Uniform:
+        return minSize <= maxSize;
+    case Kind::LogNormal:
+        return (minSize <= maxSize) && (size > 0) && (sigma > 0) && std::isfinite(sigma);
+    default:
+        return true;
+    }
+}
+
+std::unique_ptr<LoadBackend> CreateStandInLoadBackend()
+{
+    return std::make_unique<StandInLoadBackend>();
+}
+
+bool ParseLoadGeneratorOption(std::span<std::string const> args, size_t& i, LoadGeneratorOptions& options)
+{
+    std::string_view const arg{ args[i] };
+    auto const remaining = args.size() - i - 1;
+    auto const seconds = [](std::string const& value) {
+        return std::chrono::milliseconds{ static_cast<long long>(std::strtod(value.c_str(), nullptr) * 1000) };
+    };
+    auto const size = [](std::string const& value) {
+        return static_cast<size_t>(std::strtoull(value.c_str(), nullptr, 10));
+    };
+
+    if ((arg == "--op") && remaining)
+    {
+        std::string_view const op{ args[++i] };
+        if (op == "protect")
+        {
+            options.operation = LoadOperation::Protect;
+        }
+        else if (op == "unprotect")
+        {
+            options.operation = LoadOperation::Unprotect;
+        }
+        else if (op == "stream")
+        {
+            options.operation = LoadOperation::StreamOpenClose;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    else if ((arg == "--threads") && remaining)
+    {
+        options.threads = static_cast<unsigned>(std::strtoul(args[++i].c_str(), nullptr, 10));
+    }
+    else if ((arg == "--rate") && remaining)
+    {
+        options.requestsPerSecondPerThread = std::strtod(args[++i].c_str(), nullptr);
+    }
+    else if ((arg == "--warmup") && remaining)
+    {
+        options.warmup = seconds(args[++i]);
+    }
+    else if ((arg == "--duration") && remaining)
+    {
+        options.duration = seconds(args[++i]);
+    }
+    else if ((arg == "--size") && remaining)
+    {
+        options.payload = { .kind = PayloadDistribution::Kind::Fixed, .size = size(args[++i]) };
+    }
+    else if ((arg == "--size-uniform") && (remaining >= 2))
+    {
+        options.payload.kind = PayloadDistribution::Kind::Uniform;
+        options.payload.minSize = size(args[++i]);
+        options.payload.maxSize = size(args[++i]);
+    }
+    else if ((arg == "--size-lognormal") && (remaining >= 3))
+    {
+        options.payload.kind = PayloadDistribution::Kind::LogNormal;
+        options.payload.size = size(args[++i]);
+        options.payload.sigma = std::strtod(args[++i].c_str(), nullptr);
+        options.payload.maxSize = size(args[++i]);
+    }
+    else
+    {
+        return false;
+    }
+    return options.payload.isValid();
+}
+
+LoadGeneratorResult RunLoadGenerator(LoadBackend& backend, LoadGeneratorOptions const& options)
+{
+    if ((options.threads == 0) || !(options.requestsPerSecondPerThread > 0))
+    {
+        throw std::invalid_argument("load generator needs at least one thread and a positive rate");
+    }
+    if (!options.payload.isValid())
+    {
+        throw std::invalid_argument("load generator payload distribution has an empty size range or a bad median or sigma");
+    }
+
+    using clock = std::chrono::steady_clock;
+    auto const interval = std::chrono::duration<double>(1.0 / options.requestsPerSecondPerThread);
+
+    std::vector<WorkerResult> results(options.threads);
+    std::latch setupDone(options.threads);
+    std::latch go(1);
+    clock::time_point start;
+
+    auto worker = [&](unsigned threadIndex)
+        {
+            auto& result = results[threadIndex];
+
+            // Build every input up front so the timed loop does nothing but the operation. A
+            // small pool of sizes drawn from the distribution is cycled through.
+            constexpr size_t c_inputPoolSize = 64;
+            std::vector<uint8_t> randomBytes;
+            std::vector<std::span<uint8_t const>> inputs;
+            std::vector<std::vector<uint8_t>> protectedInputs;
+            try
+            {
+                std::mt19937_64 random(options.seed + threadIndex);
+                auto const largest = (options.payload.kind == PayloadDistribution::Kind::Fixed) ? options.payload.size : options.payload.maxSize;
+                randomBytes.resize(largest);
+                std::generate(randomBytes.begin(), randomBytes.end(), [&] { return static_cast<uint8_t>(random()); });
+
+                for (size_t i = 0; i < c_inputPoolSize; ++i)
+                {
+                    inputs.push_back(std::span{ randomBytes }.first(SamplePayloadSize(options.payload, random)));
+                    if (options.operation == LoadOperation::Unprotect)
+                    {
+                        protectedInputs.push_back(backend.protect(inputs.back()));
+                    }
+                }
+            }
+            catch (...)
+            {
+                result.setupError = std::current_exception();
+            }
+
+            setupDone.count_down();
+            go.wait();
+            if (result.setupError)
+            {
+                return;
+            }
+
+            // Stagger the threads' schedules across one interval so they don't all fire at once.
+            auto const first = start + std::chrono::duration_cast<clock::duration>(interval * threadIndex / options.threads);
+            auto const measureFrom = start + options.warmup;
+            auto const end = measureFrom + options.duration;
+            for (uint64_t i = 0; ; ++i)
+            {
+                auto const due = first + std::chrono::duration_cast<clock::duration>(interval * static_cast<double>(i));
+                if (due >= end)
+                {
+                    break;
+                }
+
+                WaitUntil(due);
+                bool succeeded = true;
+                try
+                {
+                    auto const slot = i % c_inputPoolSize;
+                    switch (options.operation)
+                    {
+                    case LoadOperation::Protect:
+                        backend.protect(inputs[slot]);
+                        break;
+                    case LoadOperation::Unprotect:
+                        backend.unprotect(protectedInputs[slot]);
+                        break;
+                    case LoadOperation::StreamOpenClose:
+                        backend.openCloseStream();
+                        break;
+                    }
+                }
+                catch (...)
+                {
+                    succeeded = false;
+                }
+
+                // Measured from when the request was due, not when it actually started.
+                auto const done = clock::now();
+                if (due >= measureFrom)
+                {
+                    if (succeeded)
+                    {
+                        result.histogram.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(done - due).count()));
+                        ++result.completed;
+                    }
+                    else
+                    {
+                        ++result.errors;
+                    }
+                }
+            }
+        };
+
+    {
+        std::vector<std::jthread> threads;
+        threads.reserve(options.threads);
+        for (unsigned i = 0; i < options.threads; ++i)
+        {
+            threads.emplace_back(worker, i);
+        }
+
+        setupDone.wait();
+        start = clock::now();
+        go.count_down();
+    }
+
+    LoadGeneratorResult combined;
+    combined.backend = backend.name();
+    combined.options = options;
+    combined.elapsed = clock::now() - (start + options.warmup);
+    for (auto& result : results)
+    {
+        if (result.setupError)
+        {
+            std::rethrow_exception(result.setupError);
+        }
+        combined.latencyNanoseconds.merge(result.histogram);
+        combined.completed += result.completed;
+        combined.errors += result.errors;
+    }
+    return combined;
+}
+
+void LoadGeneratorResult::writeJson(std::ostream& out) const
+{
+    auto const& h = latencyNanoseconds;
+    out << "{\n";
+    out << "  \"backend\": ";
+    WriteJsonString(out, backend);
+    out << ",\n";
+    out << "  \"operation\": \"" << OperationName(options.operation) << "\",\n";
+    out << "  \"payload\": { \"distribution\": \"" << PayloadKindName(options.payload.kind) << "\", \"size\": " << options.payload.size
+        << ", \"minSize\": " << options.payload.minSize << ", \"maxSize\": " << options.payload.maxSize << ", \"sigma\": " << options.payload.sigma << " },\n";
+    out << "  \"threads\": " << options.threads << ",\n";
+    out << "  \"targetRequestsPerSecond\": " << options.requestsPerSecondPerThread * options.threads << ",\n";
+    out << "  \"achievedRequestsPerSecond\": " << achievedRequestsPerSecond() << ",\n";
+    out << "  \"warmupSeconds\": " << std::chrono::duration<double>(options.warmup).count() << ",\n";
+    out << "  \"elapsedSeconds\": " << elapsed.count() << ",\n";
+    out << "  \"completed\": " << completed << ",\n";
+    out << "  \"errors\": " << errors << ",\n";
+    out << "  \"latencyNs\": { \"min\": " << h.minValue() << ", \"mean\": " << h.mean()
+        << ", \"p50\": " << h.valueAtPercentile(50) << ", \"p90\": " << h.valueAtPercentile(90)
+        << ", \"p99\": " << h.valueAtPercentile(99) << ", \"p99.9\": " << h.valueAtPercentile(99.9)
+        << ", \"p99.99\": " << h.valueAtPercentile(99.99) << ", \"max\": " << h.maxValue() << " },\n";
+    out << "  \"histogram\": [";
+    bool firstBucket = true;
+    h.forEachBucket([&](uint64_t value, uint64_t count)
+        {
+            out << (firstBucket ? "" : ", ") << "[" << value << ", " << count << "]";
+            firstBucket = false;
+        });
+    out << "]\n";
+    out << "}\n";
+}
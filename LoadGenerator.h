@@ -0,0 +1,151 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <span>
+#include <string>
+#include <vector>
+
+// Latency histogram in the style of HdrHistogram: values are grouped into buckets whose width
+// grows with the value, so every recorded value is kept to within 1/128 (under 1%) of its true
+// size across the full 64-bit range, in a fixed ~60KB of counters. Histograms from several
+// threads can be merged before reading percentiles.
+struct LatencyHistogram
+{
+    LatencyHistogram();
+
+    void record(uint64_t value);
+    void merge(LatencyHistogram const& other);
+
+    uint64_t count() const { return m_count; }
+    uint64_t minValue() const { return m_count ? m_min : 0; }
+    uint64_t maxValue() const { return m_max; }
+    double mean() const { return m_count ? static_cast<double>(m_sum) / m_count : 0.0; }
+
+    // The value (to within bucket precision) that 'percentile' percent of recorded values are
+    // at or below; valueAtPercentile(99.9) is the p99.9.
+    uint64_t valueAtPercentile(double percentile) const;
+
+    // Calls fn(highestValueInBucket, count) for each non-empty bucket, in increasing order.
+    template<typename Fn> void forEachBucket(Fn&& fn) const
+    {
+        for (size_t i = 0; i < m_counts.size(); ++i)
+        {
+            if (m_counts[i])
+            {
+                fn(HighestValueAt(i), m_counts[i]);
+            }
+        }
+    }
+
+private:
+    static constexpr unsigned c_subBucketBits = 7;
+    static size_t IndexOf(uint64_t value);
+    static uint64_t HighestValueAt(size_t index);
+
+    std::vector<uint64_t> m_counts;
+    uint64_t m_count{ 0 };
+    uint64_t m_sum{ 0 };
+    uint64_t m_min{ UINT64_MAX };
+    uint64_t m_max{ 0 };
+};
+
+// What the load generator drives. Implementations must be safe to call from many threads at
+// once. Failures are reported by throwing.
+struct LoadBackend
+{
+    virtual ~LoadBackend() = default;
+
+    virtual std::string name() const = 0;
+
+    // Protects 'data' and returns the protected form; used both as a measured operation and
+    // to build inputs for unprotect().
+    virtual std::vector<uint8_t> protect(std::span<uint8_t const> data) = 0;
+    virtual void unprotect(std::span<uint8_t const> protectedData) = 0;
+
+    // Opens a protect stream and closes it again without writing anything.
+    virtual void openCloseStream() = 0;
+};
+
+// In-process stand-in for the real provider. It does work proportional to the payload size
+// (a copy and a byte transform) but needs no keys, no NCrypt and no network, so the harness can
+// be exercised and compared against on any box.
+std::unique_ptr<LoadBackend> CreateStandInLoadBackend();
+
+// The real thing: ProtectBuffer, UnprotectBuffer and protect streams from a DataProtectionProvider
+// for the given scope.
+std::unique_ptr<LoadBackend> CreateDataProtectionLoadBackend(std::wstring const& scope);
+
+enum class LoadOperation
+{
+    Protect,
+    Unprotect,
+    StreamOpenClose,
+};
+
+struct PayloadDistribution
+{
+    enum class Kind
+    {
+        Fixed,      // always 'size'
+        Uniform,    // uniform in [minSize, maxSize]
+        LogNormal,  // log-normal around 'size' (the median) with 'sigma', clamped to [minSize, maxSize]
+    };
+
+    Kind kind{ Kind::Fixed };
+    size_t size{ 1024 };
+    size_t minSize{ 1 };
+    size_t maxSize{ 1024 * 1024 };
+    double sigma{ 1.0 };
+
+    // Whether the parameters are usable for 'kind': minSize <= maxSize for Uniform and LogNormal,
+    // and a positive median and sigma for LogNormal.
+    bool isValid() const;
+};
+
+struct LoadGeneratorOptions
+{
+    LoadOperation operation{ LoadOperation::Protect };
+    PayloadDistribution payload;
+    unsigned threads{ 4 };
+
+    // Each thread schedules its requests at fixed intervals at this rate, but runs them one at a
+    // time, so at most 'threads' are in flight and a backend slower than the interval caps the
+    // achieved rate below the target. Latency is measured from when a request was due to start,
+    // not when it did, so time spent waiting behind a slow request still counts against it
+    // instead of being silently dropped (the wrk2-style correction for coordinated omission).
+    double requestsPerSecondPerThread{ 1000.0 };
+
+    std::chrono::milliseconds warmup{ 1000 };
+    std::chrono::milliseconds duration{ 10000 };
+    uint64_t seed{ 1 };
+};
+
+struct LoadGeneratorResult
+{
+    std::string backend;
+    LoadGeneratorOptions options;
+    LatencyHistogram latencyNanoseconds;
+    uint64_t completed{ 0 };
+    uint64_t errors{ 0 };
+    std::chrono::duration<double> elapsed{};
+
+    double achievedRequestsPerSecond() const
+    {
+        return elapsed.count() > 0 ? completed / elapsed.count() : 0.0;
+    }
+
+    // Machine-readable results: configuration, counts, summary percentiles, and the non-empty
+    // histogram buckets as [highestValueNs, count] pairs.
+    void writeJson(std::ostream& out) const;
+};
+
+LoadGeneratorResult RunLoadGenerator(LoadBackend& backend, LoadGeneratorOptions const& options);
+
+// Parses the command-line option at args[i] (and its values) into 'options', leaving i on the
+// last argument consumed. Shared by every loadgen driver; options that pick a backend or an
+// output are left to the driver. Returns false if the option isn't one of these, is missing
+// values, has an unknown value, or leaves the payload distribution invalid.
+bool ParseLoadGeneratorOption(std::span<std::string const> args, size_t& i, LoadGeneratorOptions& options);
@@ -0,0 +1,246 @@
+#include "pch.h"
+#include "ProtectedFileStore.h"
+
+namespace
+{
+    // Sidecar layout: this header, then the scope in UTF-8.
+    struct ProtectedFileMetadataHeader
+    {
+        static constexpr uint32_t c_magic = 0x444D5044; // "DPMD"
+        static constexpr uint32_t c_version = 1;
+        static constexpr uint32_t c_maxScopeSize = 64 * 1024;
+
+        uint32_t magic{ c_magic };
+        uint32_t version{ c_version };
+        uint32_t format{ 0 };
+        uint32_t scopeSize{ 0 };
+        uint64_t plaintextSize{ 0 };
+        uint64_t ciphertextSize{ 0 };
+        uint64_t checksum{ 0 };
+        uint64_t lastWriteTime{ 0 };
+    };
+
+    std::filesystem::path MetadataPathFor(std::filesystem::path const& path)
+    {
+        auto metadataPath = path;
+        metadataPath += c_protectedMetadataSuffix;
+        return metadataPath;
+    }
+}
+
+wil::unique_hfile OpenProtectedFileForRead(std::filesystem::path const& path, FileIoMode mode)
+{
+    // Another approach would be to map the file and just point the NCrypt APIs at the mapped
+    // memory, eliminating a buffer. But, it's not super clear the size of write-chunks the NCrypt
+    // APIs can handle - trying to decrypt a 2gb file might hit memory-size limitations inside
+    // that implementation.
+    DWORD const flags = (mode == FileIoMode::Direct) ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN;
+    wil::unique_hfile file{ ::CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | flags, nullptr) };
+    THROW_LAST_ERROR_IF(!file);
+    return file;
+}
+
+uint64_t DecryptFileToSink(std::filesystem::path const& path, IStream* output, FileIoMode mode)
+{
+    return DecryptFileToSink(path, StreamSink{ output }, mode);
+}
+
+uint64_t DecryptFileToSink(std::filesystem::path const& path, HANDLE output, FileIoMode mode)
+{
+    return DecryptFileToSink(path, HandleSink{ output }, mode);
+}
+
+uint64_t DecryptFileToSink(std::filesystem::path const& path, std::function<void(std::span<uint8_t const>)> const& output, FileIoMode mode)
+{
+    return DecryptFileToSink(path, CallbackSink{ std::cref(output) }, mode);
+}
+
+void EncryptStreamToFile(IStream* source, std::filesystem::path const& path, std::wstring const& cryptDescriptor, FileIoMode mode)
+{
+    // Drop the sidecar describing whatever was here before first, so a failure part way through
+    // can't leave it describing the new content.
+    DeleteProtectedFileMetadata(path);
+
+    DataProtectionProvider provider(cryptDescriptor);
+    ProtectedFileMetadata metadata{ .format = ProtectedFormat::Stream, .scope = cryptDescriptor };
+
+    // Read chunks from the stream and push them through the encryption stream, which writes
+    // the protected bytes straight to the file as they are produced.
+    auto protect = [&](auto& fileSink)
+        {
+            ChecksumSink checksum{ fileSink };
+            CryptoStream stream{ provider.descriptor(), checksum, NCRYPT_SILENT_FLAG };
+            StreamSource streamSource{ source };
+            PumpCryptoStream(streamSource, stream);
+            metadata.plaintextSize = stream.consumed();
+            metadata.ciphertextSize = checksum.written;
+            metadata.checksum = checksum.checksum;
+        };
+
+    if (mode == FileIoMode::Direct)
+    {
+        // Write-through as well as unbuffered, so the ciphertext doesn't sit in the cache waiting
+        // for the lazy writer either. The sink pads the last block out to a sector and trims the
+        // file back to its real length when it's finished.
+        wil::unique_hfile fileHandle{ ::CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, nullptr) };
+        THROW_LAST_ERROR_IF(!fileHandle);
+
+        DirectFileSink sink{ fileHandle.get() };
+        protect(sink);
+        sink.finish();
+    }
+    else
+    {
+        // Open the given file path for write; always create it, we'll trim the size at the end.
+        wil::unique_hfile fileHandle{ ::CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr) };
+        THROW_LAST_ERROR_IF(!fileHandle);
+
+        HandleSink sink{ fileHandle.get() };
+        protect(sink);
+
+        // Set the EOF on the file
+        THROW_LAST_ERROR_IF(!::SetEndOfFile(fileHandle.get()));
+    }
+
+    WriteProtectedFileMetadata(path, metadata);
+}
+
+void ProtectBufferToFile(std::span<uint8_t const> data, std::filesystem::path const& path, DataProtectionProvider& provider)
+{
+    auto buffer = provider.ProtectBuffer(data);
+    wil::unique_hfile file{ ::CreateFileW(path.c_str(), FILE_GENERIC_WRITE, 0, nullptr, CREATE_NEW, 0, nullptr) };
+    THROW_LAST_ERROR_IF(!file);
+
+    HandleSink sink{ file.get() };
+    ChecksumSink checksum{ sink };
+    checksum.write(buffer.as_span<uint8_t>());
+    THROW_IF_WIN32_BOOL_FALSE(::SetEndOfFile(file.get()));
+    file.reset();
+
+    WriteProtectedFileMetadata(path, {
+        .format = ProtectedFormat::Buffer,
+        .scope = provider.scope(),
+        .plaintextSize = data.size(),
+        .ciphertextSize = checksum.written,
+        .checksum = checksum.checksum,
+    });
+}
+
+DataProtectionBuffer UnprotectFileToBuffer(std::filesystem::path const& path, DWORD flags)
+{
+    auto file = OpenProtectedFileForRead(path);
+    LARGE_INTEGER fileSize{};
+    THROW_IF_WIN32_BOOL_FALSE(::GetFileSizeEx(file.get(), &fileSize));
+    THROW_WIN32_IF(ERROR_FILE_TOO_LARGE, static_cast<uint64_t>(fileSize.QuadPart) > ULONG_MAX);
+
+    std::vector<uint8_t> ciphertext(static_cast<size_t>(fileSize.QuadPart));
+    HandleSource source{ file.get() };
+    for (size_t offset = 0; offset < ciphertext.size(); )
+    {
+        auto const read = source.read(std::span{ ciphertext }.subspan(offset));
+        THROW_WIN32_IF(ERROR_HANDLE_EOF, read == 0);
+        offset += read;
+    }
+
+    wil::unique_hlocal_ptr<> cleartext;
+    ULONG cleartextSize = 0;
+    THROW_IF_WIN32_ERROR(::NCryptUnprotectSecret(
+        nullptr,
+        flags,
+        ciphertext.data(),
+        static_cast<ULONG>(ciphertext.size()),
+        nullptr,
+        nullptr,
+        reinterpret_cast<BYTE**>(&cleartext),
+        &cleartextSize));
+
+    return { std::move(cleartext), cleartextSize };
+}
+
+winrt::com_ptr<IStream> DecryptFileToStream(std::filesystem::path const& path, FileIoMode mode)
+{
+    winrt::com_ptr<IStream> clearStream{ ::SHCreateMemStream(nullptr, 0), winrt::take_ownership_from_abi };
+    THROW_IF_NULL_ALLOC(clearStream);
+
+    DecryptFileToSink(path, clearStream.get(), mode);
+
+    // Move the position of the stream back to zero so the next read sees all the decrypted content
+    wil::stream_set_position(clearStream.get(), 0);
+    return clearStream;
+}
+
+void DeleteProtectedFileMetadata(std::filesystem::path const& path)
+{
+    auto const metadataPath = MetadataPathFor(path);
+    if (!::DeleteFileW(metadataPath.c_str()))
+    {
+        auto const error = ::GetLastError();
+        THROW_WIN32_IF(error, (error != ERROR_FILE_NOT_FOUND) && (error != ERROR_PATH_NOT_FOUND));
+    }
+}
+
+void WriteProtectedFileMetadata(std::filesystem::path const& path, ProtectedFileMetadata metadata)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attributes{};
+    THROW_IF_WIN32_BOOL_FALSE(::GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &attributes));
+    metadata.lastWriteTime = FileTimeToUInt64(attributes.ftLastWriteTime);
+
+    auto const scope = std::filesystem::path(metadata.scope).u8string();
+    THROW_HR_IF(E_INVALIDARG, scope.size() > ProtectedFileMetadataHeader::c_maxScopeSize);
+
+    ProtectedFileMetadataHeader header{
+        .format = static_cast<uint32_t>(metadata.format),
+        .scopeSize = static_cast<uint32_t>(scope.size()),
+        .plaintextSize = metadata.plaintextSize,
+        .ciphertextSize = metadata.ciphertextSize,
+        .checksum = metadata.checksum,
+        .lastWriteTime = metadata.lastWriteTime,
+    };
+    std::vector<uint8_t> frame(sizeof(header) + scope.size());
+    memcpy(frame.data(), &header, sizeof(header));
+    memcpy(frame.data() + sizeof(header), scope.data(), scope.size());
+
+    // Small enough to go out in one write. A sidecar torn by a crash fails to read back, which
+    // readers treat the same as no sidecar at all.
+    auto const metadataPath = MetadataPathFor(path);
+    wil::unique_hfile file{ ::CreateFileW(metadataPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr) };
+    THROW_LAST_ERROR_IF(!file);
+    DWORD written = 0;
+    THROW_IF_WIN32_BOOL_FALSE(::WriteFile(file.get(), frame.data(), static_cast<DWORD>(frame.size()), &written, nullptr));
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_WRITE_FAULT), written != frame.size());
+}
+
+std::optional<ProtectedFileMetadata> ReadProtectedFileMetadata(std::filesystem::path const& path)
+{
+    auto const metadataPath = MetadataPathFor(path);
+    wil::unique_hfile file{ ::CreateFileW(metadataPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr) };
+    if (!file)
+    {
+        auto const error = ::GetLastError();
+        THROW_WIN32_IF(error, (error != ERROR_FILE_NOT_FOUND) && (error != ERROR_PATH_NOT_FOUND));
+        return std::nullopt;
+    }
+
+    ProtectedFileMetadataHeader header{ .magic = 0 };
+    DWORD read = 0;
+    THROW_IF_WIN32_BOOL_FALSE(::ReadFile(file.get(), &header, sizeof(header), &read, nullptr));
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA),
+        (read != sizeof(header)) ||
+        (header.magic != ProtectedFileMetadataHeader::c_magic) ||
+        (header.version != ProtectedFileMetadataHeader::c_version) ||
+        ((header.format != static_cast<uint32_t>(ProtectedFormat::Buffer)) && (header.format != static_cast<uint32_t>(ProtectedFormat::Stream))) ||
+        (header.scopeSize > ProtectedFileMetadataHeader::c_maxScopeSize));
+
+    std::u8string scope(header.scopeSize, u8'\0');
+    THROW_IF_WIN32_BOOL_FALSE(::ReadFile(file.get(), scope.data(), header.scopeSize, &read, nullptr));
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), read != header.scopeSize);
+
+    return ProtectedFileMetadata{
+        .format = static_cast<ProtectedFormat>(header.format),
+        .scope = std::filesystem::path(scope).wstring(),
+        .plaintextSize = header.plaintextSize,
+        .ciphertextSize = header.ciphertextSize,
+        .checksum = header.checksum,
+        .lastWriteTime = header.lastWriteTime,
+    };
+}
@@ -0,0 +1,293 @@
+#include "pch.h"
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <fstream>
+#include <string_view>
+#include <unordered_map>
+#include "ProtectedFileStore.h"
+
+namespace
+{
+    // The index file is this header line and then one line per file, with tab-separated fields:
+    // size, last-write time, sidecar last-write time, format, plaintext size, ciphertext size,
+    // checksum, described last-write time, scope, relative path. Strings are UTF-8, and format
+    // zero means the file had no readable sidecar.
+    constexpr std::string_view c_indexHeader = "DPINDEX 1";
+
+    bool EqualsIgnoringCase(std::wstring_view left, std::wstring_view right)
+    {
+        return ::CompareStringOrdinal(left.data(), static_cast<int>(left.size()), right.data(), static_cast<int>(right.size()), TRUE) == CSTR_EQUAL;
+    }
+
+    std::string ToUtf8(std::wstring const& value)
+    {
+        auto const utf8 = std::filesystem::path(value).u8string();
+        return { utf8.begin(), utf8.end() };
+    }
+
+    std::wstring FromUtf8(std::string_view value)
+    {
+        return std::filesystem::path(std::u8string(value.begin(), value.end())).wstring();
+    }
+
+    struct FoundFile
+    {
+        std::wstring relativePath;
+        uint64_t size{ 0 };
+        uint64_t lastWriteTime{ 0 };
+    };
+
+    // Walks root with FindFirstFileEx, which hands back each file's size and last-write time with
+    // its name, so a large store is listed without opening or querying any file. Like
+    // EnumerateProtectedFiles, it skips directories it can't open and doesn't follow links.
+    std::vector<FoundFile> FindFilesUnder(std::filesystem::path const& root)
+    {
+        std::vector<FoundFile> files;
+        std::vector<std::wstring> pending{ std::wstring{} };
+        while (!pending.empty())
+        {
+            auto const directory = std::move(pending.back());
+            pending.pop_back();
+
+            auto const pattern = (root / directory / L"*");
+            WIN32_FIND_DATAW data{};
+            wil::unique_hfind find{ ::FindFirstFileExW(pattern.c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH) };
+            if (!find)
+            {
+                auto const error = ::GetLastError();
+                THROW_WIN32_IF(error, (error != ERROR_ACCESS_DENIED) && (error != ERROR_FILE_NOT_FOUND));
+                continue;
+            }
+
+            do
+            {
+                std::wstring_view const name{ data.cFileName };
+                if ((name == L".") || (name == L".."))
+                {
+                    continue;
+                }
+
+                auto relative = directory.empty() ? std::wstring{ name } : directory + L'\\' + std::wstring{ name };
+                if (WI_IsFlagSet(data.dwFileAttributes, FILE_ATTRIBUTE_DIRECTORY))
+                {
+                    if (WI_IsFlagClear(data.dwFileAttributes, FILE_ATTRIBUTE_REPARSE_POINT))
+                    {
+                        pending.push_back(std::move(relative));
+                    }
+                }
+                else
+                {
+                    files.push_back({
+                        std::move(relative),
+                        (static_cast<uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow,
+                        FileTimeToUInt64(data.ftLastWriteTime),
+                    });
+                }
+            } while (::FindNextFileW(find.get(), &data));
+            THROW_LAST_ERROR_IF(::GetLastError() != ERROR_NO_MORE_FILES);
+        }
+        return files;
+    }
+
+    // Splits a line of the index file into its tab-separated fields.
+    template<size_t Count> bool SplitFields(std::string_view line, std::array<std::string_view, Count>& fields)
+    {
+        for (size_t i = 0; i < Count - 1; ++i)
+        {
+            auto const tab = line.find('\t');
+            if (tab == std::string_view::npos)
+            {
+                return false;
+            }
+            fields[i] = line.substr(0, tab);
+            line.remove_prefix(tab + 1);
+        }
+        fields[Count - 1] = line;
+        return true;
+    }
+
+    bool ParseNumber(std::string_view field, uint64_t& value)
+    {
+        auto const [end, error] = std::from_chars(field.data(), field.data() + field.size(), value);
+        return (error == std::errc{}) && (end == field.data() + field.size());
+    }
+
+    void SaveProtectedFileIndex(std::filesystem::path const& indexPath, ProtectedFileIndex const& index)
+    {
+        WriteFileReplacing(indexPath, [&](std::ofstream& output) {
+            output << c_indexHeader << '\n';
+            ProtectedFileMetadata const none;
+            for (auto const& entry : index.entries)
+            {
+                auto const& metadata = entry.metadata ? *entry.metadata : none;
+                output << entry.size << '\t' << entry.lastWriteTime << '\t' << entry.metadataLastWriteTime << '\t'
+                    << static_cast<uint32_t>(metadata.format) << '\t' << metadata.plaintextSize << '\t' << metadata.ciphertextSize << '\t'
+                    << metadata.checksum << '\t' << metadata.lastWriteTime << '\t'
+                    << ToUtf8(metadata.scope) << '\t' << ToUtf8(entry.relativePath) << '\n';
+            }
+        });
+    }
+}
+
+ProtectedFileIndex LoadProtectedFileIndex(std::filesystem::path const& indexPath)
+{
+    ProtectedFileIndex index;
+    std::ifstream input(indexPath, std::ios::binary);
+    std::string line;
+    if (!std::getline(input, line) || (line != c_indexHeader))
+    {
+        return index;
+    }
+
+    while (std::getline(input, line))
+    {
+        std::array<std::string_view, 10> fields;
+        ProtectedFileIndexEntry entry;
+        ProtectedFileMetadata metadata;
+        uint64_t format = 0;
+        if (!SplitFields(line, fields) ||
+            !ParseNumber(fields[0], entry.size) ||
+            !ParseNumber(fields[1], entry.lastWriteTime) ||
+            !ParseNumber(fields[2], entry.metadataLastWriteTime) ||
+            !ParseNumber(fields[3], format) ||
+            !ParseNumber(fields[4], metadata.plaintextSize) ||
+            !ParseNumber(fields[5], metadata.ciphertextSize) ||
+            !ParseNumber(fields[6], metadata.checksum) ||
+            !ParseNumber(fields[7], metadata.lastWriteTime) ||
+            fields[9].empty())
+        {
+            // Whatever was on this line gets picked up again on the next update.
+            continue;
+        }
+
+        entry.relativePath = FromUtf8(fields[9]);
+        if (format != static_cast<uint64_t>(ProtectedFormat::Unknown))
+        {
+            metadata.format = static_cast<ProtectedFormat>(format);
+            metadata.scope = FromUtf8(fields[8]);
+            entry.metadata = std::move(metadata);
+        }
+        index.entries.push_back(std::move(entry));
+    }
+
+    std::ranges::sort(index.entries, {}, &ProtectedFileIndexEntry::relativePath);
+    return index;
+}
+
+ProtectedFileIndexSummary UpdateProtectedFileIndex(std::filesystem::path const& root, std::filesystem::path const& indexPath)
+{
+    auto const start = std::chrono::steady_clock::now();
+    auto const previous = LoadProtectedFileIndex(indexPath);
+    std::unordered_map<std::wstring_view, ProtectedFileIndexEntry const*> previousEntries;
+    for (auto const& entry : previous.entries)
+    {
+        previousEntries.emplace(entry.relativePath, &entry);
+    }
+
+    // Split what's on disk into protected files and their sidecars. An index saved under a name
+    // of the caller's choosing still isn't content, if it sits under root.
+    auto const absoluteRoot = std::filesystem::absolute(root).lexically_normal();
+    auto const indexRelative = std::filesystem::absolute(indexPath).lexically_normal().lexically_relative(absoluteRoot).wstring();
+    auto const tempIndexRelative = indexRelative + c_replacingTempSuffix;
+    std::wstring_view const metadataSuffix{ c_protectedMetadataSuffix };
+
+    auto found = FindFilesUnder(root);
+    std::unordered_map<std::wstring, uint64_t> sidecarTimes;
+    std::erase_if(found, [&](FoundFile& file) {
+        if (file.relativePath.ends_with(metadataSuffix))
+        {
+            sidecarTimes.emplace(file.relativePath.substr(0, file.relativePath.size() - metadataSuffix.size()), file.lastWriteTime);
+            return true;
+        }
+        return !IsProtectedContentFile(file.relativePath) ||
+            EqualsIgnoringCase(file.relativePath, indexRelative) ||
+            EqualsIgnoringCase(file.relativePath, tempIndexRelative);
+    });
+
+    ProtectedFileIndexSummary summary;
+    ProtectedFileIndex index;
+    index.entries.reserve(found.size());
+    std::vector<size_t> changed;
+    size_t stillPresent = 0;
+    for (auto& file : found)
+    {
+        auto& entry = index.entries.emplace_back();
+        entry.relativePath = std::move(file.relativePath);
+        entry.size = file.size;
+        entry.lastWriteTime = file.lastWriteTime;
+        if (auto sidecar = sidecarTimes.find(entry.relativePath); sidecar != sidecarTimes.end())
+        {
+            entry.metadataLastWriteTime = sidecar->second;
+        }
+
+        auto const before = previousEntries.find(entry.relativePath);
+        if (before != previousEntries.end())
+        {
+            ++stillPresent;
+            auto const& old = *before->second;
+            if ((old.size == entry.size) && (old.lastWriteTime == entry.lastWriteTime) && (old.metadataLastWriteTime == entry.metadataLastWriteTime))
+            {
+                entry.metadata = old.metadata;
+                ++summary.unchanged;
+                continue;
+            }
+        }
+
+        if (entry.metadataLastWriteTime)
+        {
+            changed.push_back(index.entries.size() - 1);
+        }
+        ++summary.refreshed;
+    }
+
+    // Reading sidecars is small random I/O, so overlap it. Each worker only touches its own
+    // entry. A damaged sidecar just leaves the file undescribed.
+    ForEachParallel(std::span{ changed }, std::thread::hardware_concurrency(), [&](size_t i)
+        {
+            auto& entry = index.entries[i];
+            try
+            {
+                entry.metadata = ReadProtectedFileMetadata(root / entry.relativePath);
+            }
+            CATCH_LOG();
+        });
+
+    std::ranges::sort(index.entries, {}, &ProtectedFileIndexEntry::relativePath);
+    summary.files = index.entries.size();
+    summary.removed = previous.entries.size() - stillPresent;
+    if (summary.refreshed || summary.removed || !std::filesystem::exists(indexPath))
+    {
+        SaveProtectedFileIndex(indexPath, index);
+    }
+
+    summary.undescribed = static_cast<size_t>(std::ranges::count_if(index.entries, [](ProtectedFileIndexEntry const& entry) { return !entry.described(); }));
+    summary.elapsed = std::chrono::steady_clock::now() - start;
+    return summary;
+}
+
+std::vector<ProtectedFileIndexEntry const*> QueryProtectedFileIndex(ProtectedFileIndex const& index, ProtectedFileQuery const& query)
+{
+    std::vector<ProtectedFileIndexEntry const*> matches;
+    for (auto const& entry : index.entries)
+    {
+        if (query.format && (entry.format() != *query.format))
+        {
+            continue;
+        }
+
+        if (!query.scope.empty() || (query.minPlaintextSize > 0) || (query.maxPlaintextSize < UINT64_MAX))
+        {
+            if (!entry.described() ||
+                (!query.scope.empty() && !EqualsIgnoringCase(entry.metadata->scope, query.scope)) ||
+                (entry.metadata->plaintextSize < query.minPlaintextSize) ||
+                (entry.metadata->plaintextSize > query.maxPlaintextSize))
+            {
+                continue;
+            }
+        }
+
+        matches.push_back(&entry);
+    }
+    return matches;
+}
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "DataProtectionProvider.h"
+
+// Runs fn(item) for every item, spread across up to threadCount threads (the calling thread is
+// one of them). Each item is handed out exactly once. fn must not throw; catch and record
+// per-item failures inside it.
+template<typename Item, typename Fn> void ForEachParallel(std::span<Item> items, unsigned threadCount, Fn&& fn)
+{
+    std::atomic<size_t> nextItem{ 0 };
+    auto worker = [&]
+        {
+            for (size_t i; (i = nextItem.fetch_add(1)) < items.size(); )
+            {
+                fn(items[i]);
+            }
+        };
+
+    threadCount = (std::max)(1u, (std::min)(threadCount, static_cast<unsigned>((std::min)(items.size(), size_t{ UINT_MAX }))));
+    std::vector<std::jthread> helpers;
+    helpers.reserve(threadCount - 1);
+    for (unsigned i = 1; i < threadCount; ++i)
+    {
+        helpers.emplace_back(worker);
+    }
+    worker();
+}
+
+// A FILETIME as a single count of 100ns intervals, which is how file times are compared and saved.
+inline uint64_t FileTimeToUInt64(FILETIME const& time)
+{
+    return (static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+}
+
+// Suffix of the temporary file WriteFileReplacing writes next to its target.
+inline constexpr wchar_t c_replacingTempSuffix[] = L".tmp";
+
+// Calls write(stream) on a temporary file next to path, flushes it to disk and then renames it over
+// path, so a crash or power loss mid-write leaves the previous contents intact. Throws if the
+// write fails.
+template<typename Fn> void WriteFileReplacing(std::filesystem::path const& path, Fn&& write)
+{
+    auto tempPath = path;
+    tempPath += c_replacingTempSuffix;
+    {
+        std::ofstream output(tempPath, std::ios::binary | std::ios::trunc);
+        write(output);
+        output.close();
+        THROW_HR_IF(E_FAIL, output.fail());
+    }
+
+    // The stream only hands its data to the OS; flushing any handle to the file pushes the
+    // cached data to disk before the rename can make it the only copy.
+    {
+        wil::unique_hfile file{ ::CreateFileW(tempPath.c_str(), GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr) };
+        THROW_LAST_ERROR_IF(!file);
+        THROW_IF_WIN32_BOOL_FALSE(::FlushFileBuffers(file.get()));
+    }
+    THROW_IF_WIN32_BOOL_FALSE(::MoveFileExW(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH));
+}
+
+// Suffix of the temporary file a re-protection writes next to the original before swapping it in.
+inline constexpr wchar_t c_reprotectTempSuffix[] = L".reprotect-tmp";
+
+// Name UpdateProtectedFileIndex's index gets by default, at the top of the root it describes.
+inline constexpr wchar_t c_protectedIndexSuffix[] = L".dpindex";
+
+// False for the files the tools keep beside protected content - metadata sidecars, indexes, and
+// the temporaries of index updates and re-protections - which verify, reprotect and index all
+// leave alone.
+inline bool IsProtectedContentFile(std::wstring_view path)
+{
+    if (path.ends_with(c_replacingTempSuffix))
+    {
+        path.remove_suffix(std::size(c_replacingTempSuffix) - 1);
+        return !path.ends_with(c_protectedIndexSuffix);
+    }
+    return !path.ends_with(c_protectedMetadataSuffix) &&
+        !path.ends_with(c_reprotectTempSuffix) &&
+        !path.ends_with(c_protectedIndexSuffix);
+}
+
+// Lists every regular file under root, recursively, that IsProtectedContentFile accepts.
+std::vector<std::filesystem::path> EnumerateProtectedFiles(std::filesystem::path const& root);
+
+// The format the file's sidecar records, or Unknown if it has no readable sidecar. Verify and
+// reprotect take Unknown files to be in the stream format.
+ProtectedFormat GetRecordedFormat(std::filesystem::path const& path);
+
+enum class VerifyStatus
+{
+    Verified,
+    Skipped,
+    Failed,
+};
+
+struct VerifyFileResult
+{
+    std::filesystem::path path;
+    VerifyStatus status{ VerifyStatus::Failed };
+    HRESULT error{ S_OK };
+    uint64_t ciphertextSize{ 0 };
+    uint64_t cleartextSize{ 0 };
+};
+
+struct VerifyOptions
+{
+    // Number of files checked at once. Zero means one per hardware thread. Each file in flight
+    // holds one read buffer, so memory use is bounded by this rather than by file sizes.
+    unsigned threadCount{ 0 };
+
+    // When set, files whose size and last-write time match the last clean scan recorded in this
+    // file are skipped, and the file is rewritten with the results of this scan.
+    std::filesystem::path incrementalState;
+
+    // Called once per file with its result. Calls are serialized, but come from worker threads.
+    std::function<void(VerifyFileResult const&)> onResult;
+};
+
+struct VerifySummary
+{
+    size_t verified{ 0 };
+    size_t skipped{ 0 };
+    size_t failed{ 0 };
+    uint64_t ciphertextBytes{ 0 };
+    uint64_t cleartextBytes{ 0 };
+    std::chrono::duration<double> elapsed{};
+
+    // Ciphertext bytes checked per second over the whole scan.
+    double bytesPerSecond() const
+    {
+        return elapsed.count() > 0 ? ciphertextBytes / elapsed.count() : 0.0;
+    }
+};
+
+// Checks that a protected file decrypts completely - that the current user has access to its
+// scope, and that it is neither truncated nor corrupted. Stream-format cleartext is thrown away as
+// it is produced; a file whose sidecar records the buffer format is decrypted whole with
+// UnprotectFileToBuffer. Failures are reported in the result rather than thrown.
+VerifyFileResult VerifyProtectedFile(std::filesystem::path const& path);
+
+// Runs VerifyProtectedFile over every file under root, several at a time.
+VerifySummary VerifyProtectedFiles(std::filesystem::path const& root, VerifyOptions const& options = {});
+
+struct ReprotectFileResult
+{
+    std::filesystem::path path;
+    HRESULT error{ S_OK };
+    uint64_t cleartextSize{ 0 };
+};
+
+struct ReprotectOptions
+{
+    // Number of files rewritten at once. Zero means one per hardware thread.
+    unsigned threadCount{ 0 };
+
+    // Called once per file with its result. Calls are serialized, but come from worker threads.
+    std::function<void(ReprotectFileResult const&)> onResult;
+};
+
+struct ReprotectSummary
+{
+    size_t reprotected{ 0 };
+    size_t failed{ 0 };
+    uint64_t cleartextBytes{ 0 };
+    std::chrono::duration<double> elapsed{};
+
+    double bytesPerSecond() const
+    {
+        return elapsed.count() > 0 ? cleartextBytes / elapsed.count() : 0.0;
+    }
+};
+
+// Rewrites a protected file under the target provider's scope, keeping its format. For the stream
+// format it's a single pass: the unprotect stream feeds the protect stream directly, so only one
+// read chunk of cleartext is in memory at a time. A file whose sidecar records the buffer format
+// is unprotected and protected whole. The new content goes to a temporary file that then replaces the
+// original, keeping the original's attributes and security. The file's metadata sidecar is removed
+// just before the swap and rewritten for the new scope after it; failing to rewrite it is logged
+// rather than thrown, since the content has already moved. On any other failure the original
+// content is left untouched, though it may have lost its sidecar. Throws on failure.
+uint64_t ReprotectFile(std::filesystem::path const& path, DataProtectionProvider const& target);
+
+// Runs ReprotectFile over every file under root, several at a time. Leftover temporary files
+// from an interrupted run are ignored.
+ReprotectSummary ReprotectFiles(std::filesystem::path const& root, DataProtectionProvider const& target, ReprotectOptions const& options = {});
+
+// One protected file in a ProtectedFileIndex. 'size' and 'lastWriteTime' are the file's own as of
+// the last update, and 'metadata' is what its sidecar said then, if it had a readable one.
+struct ProtectedFileIndexEntry
+{
+    std::wstring relativePath;
+    uint64_t size{ 0 };
+    uint64_t lastWriteTime{ 0 };
+
+    // The sidecar's own last-write time, or zero if there was no sidecar.
+    uint64_t metadataLastWriteTime{ 0 };
+    std::optional<ProtectedFileMetadata> metadata;
+
+    // True when the sidecar was written for this version of the file, rather than one it has
+    // since been overwritten or modified from.
+    bool described() const
+    {
+        return metadata && (metadata->ciphertextSize == size) && (metadata->lastWriteTime == lastWriteTime);
+    }
+
+    ProtectedFormat format() const
+    {
+        return described() ? metadata->format : ProtectedFormat::Unknown;
+    }
+};
+
+// What is known about every file under a storage root, built from the sidecars alone, so it can be
+// listed and filtered without decrypting anything.
+struct ProtectedFileIndex
+{
+    // Sorted by relativePath.
+    std::vector<ProtectedFileIndexEntry> entries;
+};
+
+struct ProtectedFileIndexSummary
+{
+    size_t files{ 0 };
+    size_t unchanged{ 0 };
+    size_t refreshed{ 0 };
+    size_t removed{ 0 };
+
+    // Files with no sidecar, or one that doesn't match them.
+    size_t undescribed{ 0 };
+    std::chrono::duration<double> elapsed{};
+};
+
+struct ProtectedFileQuery
+{
+    // Matches files described as this format; ProtectedFormat::Unknown matches undescribed files.
+    std::optional<ProtectedFormat> format;
+
+    // When set, matches described files with this scope, ignoring case.
+    std::wstring scope;
+
+    uint64_t minPlaintextSize{ 0 };
+    uint64_t maxPlaintextSize{ UINT64_MAX };
+};
+
+// Loads an index saved by UpdateProtectedFileIndex. A missing or unreadable index file gives an
+// empty index.
+ProtectedFileIndex LoadProtectedFileIndex(std::filesystem::path const& indexPath);
+
+// Brings the index at indexPath up to date with the files under root and saves it. Files whose
+// size and last-write time, and whose sidecar's last-write time, match the saved index are taken
+// from it as they are; only new and changed files have their sidecars read, and the index file is
+// left alone if none were. Nothing is decrypted.
+ProtectedFileIndexSummary UpdateProtectedFileIndex(std::filesystem::path const& root, std::filesystem::path const& indexPath);
+
+// The entries matching every condition in the query, in path order.
+std::vector<ProtectedFileIndexEntry const*> QueryProtectedFileIndex(ProtectedFileIndex const& index, ProtectedFileQuery const& query);
@@ -0,0 +1,383 @@
+#include "pch.h"
+#include "DataProtectionProvider.h"
+
+namespace
+{
+    // Positional read that doesn't care where the file pointer is. Returns the number of bytes
+    // read, which is less than requested only at the end of the file.
+    DWORD ReadAt(HANDLE file, uint64_t offset, void* buffer, DWORD size)
+    {
+        OVERLAPPED position{};
+        position.Offset = static_cast<DWORD>(offset);
+        position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD read = 0;
+        if (!::ReadFile(file, buffer, size, &read, &position))
+        {
+            auto const error = ::GetLastError();
+            THROW_WIN32_IF(error, error != ERROR_HANDLE_EOF);
+            return 0;
+        }
+        return read;
+    }
+
+    uint64_t GetFileSize(HANDLE file)
+    {
+        LARGE_INTEGER size{};
+        THROW_IF_WIN32_BOOL_FALSE(::GetFileSizeEx(file, &size));
+        return static_cast<uint64_t>(size.QuadPart);
+    }
+
+    bool IsValidHeader(ProtectedLogSegmentHeader const& header)
+    {
+        return (header.magic == ProtectedLogSegmentHeader::c_magic) && (header.version == ProtectedLogSegmentHeader::c_version);
+    }
+
+    // The errors a segment cut short or only partly on disk fails to decrypt with. Anything else -
+    // a caller without access to the scope, say - isn't about the segment and must not be taken
+    // for a torn tail.
+    bool IsTornSegmentError(HRESULT error)
+    {
+        return (error == NTE_BAD_DATA) || (error == HRESULT_FROM_WIN32(ERROR_INVALID_DATA));
+    }
+
+    // Decrypts the segment at 'offset' and checks it yields as much cleartext as its header says.
+    // Throws if decryption fails for any reason other than damaged content.
+    bool SegmentDecrypts(HANDLE file, uint64_t offset, ProtectedLogSegmentHeader const& header)
+    {
+        if (header.ciphertextSize > MAXDWORD)
+        {
+            return false;
+        }
+
+        std::vector<uint8_t> ciphertext(static_cast<size_t>(header.ciphertextSize));
+        if (ReadAt(file, offset + sizeof(header), ciphertext.data(), static_cast<DWORD>(ciphertext.size())) != ciphertext.size())
+        {
+            return false;
+        }
+
+        try
+        {
+            DiscardSink sink;
+            UnprotectToSink(SpanSource{ ciphertext }, sink, NCRYPT_SILENT_FLAG);
+            return sink.written == header.plaintextSize;
+        }
+        catch (...)
+        {
+            if (!IsTornSegmentError(wil::ResultFromCaughtException()))
+            {
+                throw;
+            }
+            LOG_CAUGHT_EXCEPTION();
+            return false;
+        }
+    }
+
+    // Whether a complete segment with a valid header starts anywhere after 'offset'. That tells
+    // damage in the middle of a log apart from a segment torn at its tail.
+    bool HasSegmentAfter(HANDLE file, uint64_t offset, uint64_t fileSize)
+    {
+        std::vector<uint8_t> buffer(64 * 1024);
+        auto position = offset + 1;
+        while (fileSize - position >= sizeof(ProtectedLogSegmentHeader))
+        {
+            auto const read = ReadAt(file, position, buffer.data(), static_cast<DWORD>(buffer.size()));
+            if (read < sizeof(ProtectedLogSegmentHeader))
+            {
+                break;
+            }
+
+            for (size_t i = 0; i + sizeof(ProtectedLogSegmentHeader) <= read; ++i)
+            {
+                ProtectedLogSegmentHeader candidate;
+                memcpy(&candidate, buffer.data() + i, sizeof(candidate));
+                if (IsValidHeader(candidate) && (candidate.ciphertextSize <= fileSize - position - i - sizeof(candidate)))
+                {
+                    return true;
+                }
+            }
+
+            // Overlap the next read so a header straddling the two is still seen.
+            position += read - sizeof(ProtectedLogSegmentHeader) + 1;
+        }
+        return false;
+    }
+}
+
+ProtectedLogWriter::ProtectedLogWriter(NCRYPT_DESCRIPTOR_HANDLE descriptor, std::filesystem::path const& path, ProtectedLogOptions const& options) :
+    m_descriptor(descriptor),
+    m_options(options)
+{
+    // Segments are written with a single WriteFile, so they have to fit in a DWORD once
+    // the protection overhead is added.
+    THROW_HR_IF(E_INVALIDARG, (m_options.segmentBytes == 0) || (m_options.segmentBytes > MAXDWORD / 2));
+
+    // Readers tail the log while it's open, so let them in.
+    m_file.reset(::CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+    THROW_LAST_ERROR_IF(!m_file);
+    OpenExisting();
+
+    if (m_options.segmentInterval.count() > 0)
+    {
+        m_timer.reset(::CreateThreadpoolTimer([](PTP_CALLBACK_INSTANCE, void* context, PTP_TIMER)
+            {
+                static_cast<ProtectedLogWriter*>(context)->OnTimer();
+            }, this, nullptr));
+        THROW_LAST_ERROR_IF(!m_timer);
+
+        // Check the open segment's age a few times per interval so a segment is never held
+        // open much longer than requested.
+        auto const period = (std::max)(static_cast<DWORD>(m_options.segmentInterval.count() / 4), 1ul);
+        LARGE_INTEGER dueTime{};
+        dueTime.QuadPart = -static_cast<LONGLONG>(period) * 10000;
+        FILETIME dueFileTime{ dueTime.LowPart, static_cast<DWORD>(dueTime.HighPart) };
+        ::SetThreadpoolTimer(m_timer.get(), &dueFileTime, period, 0);
+    }
+}
+
+ProtectedLogWriter::~ProtectedLogWriter()
+{
+    if (m_file)
+    {
+        try
+        {
+            close();
+        }
+        CATCH_LOG();
+    }
+}
+
+void ProtectedLogWriter::OpenExisting()
+{
+    // Walk the segments already in the file to find the end of the last good one. A crash while
+    // sealing can only damage the last frame: its header is short or zero-filled, the frame is
+    // cut short, or a good header sits in front of ciphertext that never made it to disk. That
+    // frame is cut off so new segments follow directly after the last good one. Damage with
+    // complete segments after it is corruption rather than a torn write; truncating there would
+    // throw the later segments away, so it fails the open instead.
+    auto const fileSize = GetFileSize(m_file.get());
+    uint64_t offset = 0;
+    while (offset < fileSize)
+    {
+        ProtectedLogSegmentHeader header{ .magic = 0 };
+        auto const remaining = fileSize - offset;
+        bool const complete = (remaining >= sizeof(header)) &&
+            (ReadAt(m_file.get(), offset, &header, sizeof(header)) == sizeof(header)) &&
+            IsValidHeader(header) &&
+            (header.ciphertextSize <= remaining - sizeof(header));
+        if (!complete)
+        {
+            THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), HasSegmentAfter(m_file.get(), offset, fileSize));
+            break;
+        }
+
+        auto const segmentEnd = offset + sizeof(header) + header.ciphertextSize;
+        if ((segmentEnd == fileSize) && !SegmentDecrypts(m_file.get(), offset, header))
+        {
+            break;
+        }
+
+        m_nextSequence = header.sequence + 1;
+        offset = segmentEnd;
+    }
+
+    LARGE_INTEGER end{};
+    end.QuadPart = static_cast<LONGLONG>(offset);
+    THROW_IF_WIN32_BOOL_FALSE(::SetFilePointerEx(m_file.get(), end, nullptr, FILE_BEGIN));
+    THROW_IF_WIN32_BOOL_FALSE(::SetEndOfFile(m_file.get()));
+    m_segmentsDurable = m_nextSequence;
+}
+
+void ProtectedLogWriter::SealSegment()
+{
+    auto closeSegment = wil::scope_exit([&] { m_segment.reset(); });
+    m_segment->finish();
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW), m_segmentFrame.size() > MAXDWORD);
+
+    ProtectedLogSegmentHeader header;
+    header.sequence = m_nextSequence;
+    header.plaintextSize = m_segmentPlaintextSize;
+    header.ciphertextSize = m_segmentFrame.size() - sizeof(header);
+    memcpy(m_segmentFrame.data(), &header, sizeof(header));
+
+    // A write that fails part way can leave some of the frame behind. Move the end of the file
+    // back to where the frame started, so the next segment doesn't land after a partial one.
+    LARGE_INTEGER frameStart{};
+    THROW_IF_WIN32_BOOL_FALSE(::SetFilePointerEx(m_file.get(), {}, &frameStart, FILE_CURRENT));
+    auto rollback = wil::scope_exit([&] {
+        LOG_IF_WIN32_BOOL_FALSE(::SetFilePointerEx(m_file.get(), frameStart, nullptr, FILE_BEGIN));
+        LOG_IF_WIN32_BOOL_FALSE(::SetEndOfFile(m_file.get()));
+    });
+
+    DWORD written = 0;
+    THROW_IF_WIN32_BOOL_FALSE(::WriteFile(m_file.get(), m_segmentFrame.data(), static_cast<DWORD>(m_segmentFrame.size()), &written, nullptr));
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_WRITE_FAULT), written != m_segmentFrame.size());
+    rollback.release();
+    ++m_nextSequence;
+}
+
+uint64_t ProtectedLogWriter::append(std::span<uint8_t const> data)
+{
+    uint64_t sequence;
+    bool sealed = false;
+    {
+        std::lock_guard lock(m_lock);
+        THROW_HR_IF(E_ILLEGAL_METHOD_CALL, !m_file);
+
+        sequence = m_nextSequence;
+        if (data.empty())
+        {
+            return sequence;
+        }
+
+        if (!m_segment)
+        {
+            // Leave room for the header at the front of the frame; it's filled in once the
+            // ciphertext size is known, and then the whole frame goes out in one write.
+            m_segmentFrame.assign(sizeof(ProtectedLogSegmentHeader), 0);
+            m_segmentPlaintextSize = 0;
+            m_segmentStart = std::chrono::steady_clock::now();
+            m_segment.emplace(m_descriptor, m_segmentSink, NCRYPT_SILENT_FLAG);
+        }
+
+        m_segment->update(data);
+        m_segmentPlaintextSize += data.size();
+
+        if (m_segmentPlaintextSize >= m_options.segmentBytes)
+        {
+            SealSegment();
+            sealed = true;
+        }
+    }
+
+    if (sealed && m_options.flushOnSeal)
+    {
+        commit();
+    }
+
+    return sequence;
+}
+
+void ProtectedLogWriter::commit()
+{
+    std::unique_lock lock(m_lock);
+    THROW_HR_IF(E_ILLEGAL_METHOD_CALL, !m_file);
+
+    if (m_segment)
+    {
+        SealSegment();
+    }
+
+    // Group commit - if someone else is already flushing, wait for them and see whether their
+    // flush covered our segments. If not (or nobody is flushing) do one flush on behalf of
+    // everyone who has written a segment so far.
+    auto const target = m_nextSequence;
+    while (m_segmentsDurable < target)
+    {
+        if (m_flushing)
+        {
+            m_flushed.wait(lock);
+            continue;
+        }
+
+        m_flushing = true;
+        auto const flushingThrough = m_nextSequence;
+        auto notifyWaiters = wil::scope_exit([&] {
+            m_flushing = false;
+            m_flushed.notify_all();
+        });
+
+        lock.unlock();
+        auto relock = wil::scope_exit([&] { lock.lock(); });
+        THROW_IF_WIN32_BOOL_FALSE(::FlushFileBuffers(m_file.get()));
+        relock.reset();
+
+        m_segmentsDurable = (std::max)(m_segmentsDurable, flushingThrough);
+    }
+}
+
+void ProtectedLogWriter::close()
+{
+    // Stop the timer first; its callback takes the lock, so it can't be drained while holding it.
+    m_timer.reset();
+    commit();
+
+    std::lock_guard lock(m_lock);
+    m_file.reset();
+}
+
+void ProtectedLogWriter::OnTimer() noexcept try
+{
+    bool sealed = false;
+    {
+        std::lock_guard lock(m_lock);
+        if (m_file && m_segment && (std::chrono::steady_clock::now() - m_segmentStart >= m_options.segmentInterval))
+        {
+            SealSegment();
+            sealed = true;
+        }
+    }
+
+    if (sealed && m_options.flushOnSeal)
+    {
+        commit();
+    }
+}
+CATCH_LOG();
+
+ProtectedLogReader::ProtectedLogReader(std::filesystem::path const& path)
+{
+    // The writer holds the file open for write, so share write access to be able to tail it.
+    m_file.reset(::CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+    THROW_LAST_ERROR_IF(!m_file);
+}
+
+size_t ProtectedLogReader::readNewSegments(std::function<void(uint64_t, std::span<uint8_t const>)> const& onSegment)
+{
+    size_t delivered = 0;
+    while (true)
+    {
+        // A header that's short or still zero-filled is a segment the writer hasn't finished
+        // putting down yet; stop here and pick it up on the next call.
+        ProtectedLogSegmentHeader header{ .magic = 0 };
+        if ((ReadAt(m_file.get(), m_offset, &header, sizeof(header)) != sizeof(header)) || (header.magic == 0))
+        {
+            break;
+        }
+
+        THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), !IsValidHeader(header) || (header.ciphertextSize > MAXDWORD));
+        auto const ciphertextSize = static_cast<DWORD>(header.ciphertextSize);
+        m_ciphertext.resize(ciphertextSize);
+        if (ReadAt(m_file.get(), m_offset + sizeof(header), m_ciphertext.data(), ciphertextSize) != ciphertextSize)
+        {
+            break;
+        }
+
+        auto const segmentEnd = m_offset + sizeof(header) + ciphertextSize;
+        m_cleartext.clear();
+        try
+        {
+            VectorSink sink{ m_cleartext };
+            UnprotectToSink(SpanSource{ m_ciphertext }, sink, NCRYPT_SILENT_FLAG);
+            THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), m_cleartext.size() != header.plaintextSize);
+        }
+        catch (...)
+        {
+            // The last segment in the file may still be landing on disk; give it another chance
+            // on the next call. A bad segment with more data after it is real corruption, and
+            // any other failure (no access to the scope, say) is reported as it is.
+            if (!IsTornSegmentError(wil::ResultFromCaughtException()) || (segmentEnd < GetFileSize(m_file.get())))
+            {
+                throw;
+            }
+            break;
+        }
+
+        // Only move past the segment once the callback has accepted it, so a callback that
+        // throws sees the same segment again next time.
+        onSegment(header.sequence, m_cleartext);
+        m_offset = segmentEnd;
+        ++delivered;
+    }
+
+    return delivered;
+}
@@ -0,0 +1,111 @@
+#include "pch.h"
+#include <mutex>
+#include "ProtectedFileStore.h"
+
+uint64_t ReprotectFile(std::filesystem::path const& path, DataProtectionProvider const& target)
+{
+    // Keep the temporary file in the same directory so the swap below is a rename on the same
+    // volume, not a copy.
+    auto tempPath = path;
+    tempPath += c_reprotectTempSuffix;
+
+    auto const format = (GetRecordedFormat(path) == ProtectedFormat::Buffer) ? ProtectedFormat::Buffer : ProtectedFormat::Stream;
+    wil::unique_hfile output{ ::CreateFileW(tempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr) };
+    THROW_LAST_ERROR_IF(!output);
+    auto removeTemp = wil::scope_exit([&] {
+        output.reset();
+        ::DeleteFileW(tempPath.c_str());
+    });
+
+    HandleSink fileSink{ output.get() };
+    ChecksumSink checksum{ fileSink };
+    uint64_t cleartextSize = 0;
+    if (format == ProtectedFormat::Buffer)
+    {
+        auto const cleartext = UnprotectFileToBuffer(path, NCRYPT_SILENT_FLAG);
+        checksum.write(target.ProtectBuffer(cleartext.as_span<uint8_t>()).as_span<uint8_t>());
+        cleartextSize = cleartext.size();
+    }
+    else
+    {
+        // Chain unprotect -> protect -> file. Each chunk read from the original is decrypted and
+        // immediately re-encrypted under the new scope on its way to the temporary file.
+        auto source = OpenProtectedFileForRead(path);
+        CryptoStream protect{ target.descriptor(), checksum, NCRYPT_SILENT_FLAG };
+        ChainedSink chain{ protect };
+        UnprotectToSink(HandleSource{ source.get() }, chain, NCRYPT_SILENT_FLAG);
+        protect.finish();
+        cleartextSize = chain.written;
+    }
+
+    // Make sure the new content is on disk before it replaces the only other copy.
+    THROW_IF_WIN32_BOOL_FALSE(::FlushFileBuffers(output.get()));
+    output.reset();
+
+    // The old sidecar names the old scope, so it goes before the swap; if the swap then fails the
+    // original is merely undescribed, never misdescribed.
+    DeleteProtectedFileMetadata(path);
+    THROW_IF_WIN32_BOOL_FALSE(::ReplaceFileW(path.c_str(), tempPath.c_str(), nullptr, REPLACEFILE_IGNORE_MERGE_ERRORS, nullptr, nullptr));
+    removeTemp.release();
+
+    // The content is rotated at this point, so a sidecar that can't be written doesn't fail the
+    // file; it is left undescribed until the next write or reprotect.
+    try
+    {
+        WriteProtectedFileMetadata(path, {
+            .format = format,
+            .scope = target.scope(),
+            .plaintextSize = cleartextSize,
+            .ciphertextSize = checksum.written,
+            .checksum = checksum.checksum,
+        });
+    }
+    CATCH_LOG();
+    return cleartextSize;
+}
+
+ReprotectSummary ReprotectFiles(std::filesystem::path const& root, DataProtectionProvider const& target, ReprotectOptions const& options)
+{
+    auto const start = std::chrono::steady_clock::now();
+    auto files = EnumerateProtectedFiles(root);
+
+    std::mutex resultLock;
+    ReprotectSummary summary;
+
+    auto const threadCount = options.threadCount ? options.threadCount : std::thread::hardware_concurrency();
+    ForEachParallel(std::span{ files }, threadCount, [&](std::filesystem::path const& path)
+        {
+            ReprotectFileResult result{ .path = path };
+            try
+            {
+                result.cleartextSize = ReprotectFile(path, target);
+            }
+            catch (...)
+            {
+                result.error = wil::ResultFromCaughtException();
+            }
+
+            std::lock_guard lock(resultLock);
+            try
+            {
+                if (SUCCEEDED(result.error))
+                {
+                    ++summary.reprotected;
+                    summary.cleartextBytes += result.cleartextSize;
+                }
+                else
+                {
+                    ++summary.failed;
+                }
+
+                if (options.onResult)
+                {
+                    options.onResult(result);
+                }
+            }
+            CATCH_LOG();
+        });
+
+    summary.elapsed = std::chrono::steady_clock::now() - start;
+    return summary;
+}
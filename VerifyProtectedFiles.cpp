@@ -0,0 +1,219 @@
+#include "pch.h"
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include "ProtectedFileStore.h"
+
+namespace
+{
+    // Size and last-write time of a file; if both match the last clean scan, the file is assumed
+    // to be unchanged since then.
+    struct FileStamp
+    {
+        uint64_t size{ 0 };
+        uint64_t lastWriteTime{ 0 };
+
+        bool operator==(FileStamp const&) const = default;
+    };
+
+    // Keyed by the file's path relative to the scan root, so a store can be moved or mounted
+    // somewhere else without invalidating its state.
+    using FileStampMap = std::unordered_map<std::wstring, FileStamp>;
+
+    FileStamp GetFileStamp(std::filesystem::path const& path)
+    {
+        WIN32_FILE_ATTRIBUTE_DATA attributes{};
+        THROW_IF_WIN32_BOOL_FALSE(::GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &attributes));
+        return {
+            (static_cast<uint64_t>(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow,
+            FileTimeToUInt64(attributes.ftLastWriteTime),
+        };
+    }
+
+    // The state file is one line per clean file: "<size> <lastWriteTime> <relative path>", with
+    // the path in UTF-8. A missing or unreadable state file just means everything is rechecked.
+    FileStampMap LoadFileStamps(std::filesystem::path const& statePath)
+    {
+        FileStampMap stamps;
+        std::ifstream state(statePath, std::ios::binary);
+        std::string line;
+        while (std::getline(state, line))
+        {
+            std::istringstream fields(line);
+            FileStamp stamp;
+            if (!(fields >> stamp.size >> stamp.lastWriteTime) || (fields.get() != ' '))
+            {
+                continue;
+            }
+
+            std::string relative;
+            std::getline(fields, relative);
+            stamps.emplace(std::filesystem::path(std::u8string(relative.begin(), relative.end())).wstring(), stamp);
+        }
+        return stamps;
+    }
+
+    void SaveFileStamps(std::filesystem::path const& statePath, FileStampMap const& stamps)
+    {
+        WriteFileReplacing(statePath, [&](std::ofstream& state) {
+            for (auto const& [relative, stamp] : stamps)
+            {
+                auto const utf8 = std::filesystem::path(relative).u8string();
+                state << stamp.size << ' ' << stamp.lastWriteTime << ' ';
+                state.write(reinterpret_cast<char const*>(utf8.data()), utf8.size());
+                state << '\n';
+            }
+        });
+    }
+}
+
+std::vector<std::filesystem::path> EnumerateProtectedFiles(std::filesystem::path const& root)
+{
+    std::vector<std::filesystem::path> files;
+    for (auto const& entry : std::filesystem::recursive_directory_iterator(root, std::filesystem::directory_options::skip_permission_denied))
+    {
+        if (entry.is_regular_file() && IsProtectedContentFile(entry.path().native()))
+        {
+            files.push_back(entry.path());
+        }
+    }
+    return files;
+}
+
+ProtectedFormat GetRecordedFormat(std::filesystem::path const& path)
+{
+    try
+    {
+        if (auto const metadata = ReadProtectedFileMetadata(path))
+        {
+            return metadata->format;
+        }
+    }
+    CATCH_LOG();
+    return ProtectedFormat::Unknown;
+}
+
+VerifyFileResult VerifyProtectedFile(std::filesystem::path const& path)
+{
+    VerifyFileResult result{ .path = path };
+    try
+    {
+        if (GetRecordedFormat(path) == ProtectedFormat::Buffer)
+        {
+            result.ciphertextSize = std::filesystem::file_size(path);
+            result.cleartextSize = UnprotectFileToBuffer(path, NCRYPT_SILENT_FLAG).size();
+            result.status = VerifyStatus::Verified;
+            return result;
+        }
+
+        auto file = OpenProtectedFileForRead(path);
+
+        LARGE_INTEGER fileSize{};
+        THROW_IF_WIN32_BOOL_FALSE(::GetFileSizeEx(file.get(), &fileSize));
+        result.ciphertextSize = static_cast<uint64_t>(fileSize.QuadPart);
+
+        // Decrypting is the only way to know the content is intact and the scope is still
+        // reachable; the cleartext itself isn't needed, so it's counted and dropped.
+        DiscardSink sink;
+        UnprotectToSink(HandleSource{ file.get() }, sink, NCRYPT_SILENT_FLAG);
+        result.cleartextSize = sink.written;
+        result.status = VerifyStatus::Verified;
+    }
+    catch (...)
+    {
+        result.status = VerifyStatus::Failed;
+        result.error = wil::ResultFromCaughtException();
+    }
+    return result;
+}
+
+VerifySummary VerifyProtectedFiles(std::filesystem::path const& root, VerifyOptions const& options)
+{
+    auto const start = std::chrono::steady_clock::now();
+    auto files = EnumerateProtectedFiles(root);
+
+    // The state file may well live in the store it describes; it isn't protected content.
+    bool const incremental = !options.incrementalState.empty();
+    if (incremental)
+    {
+        auto const statePath = std::filesystem::absolute(options.incrementalState).lexically_normal();
+        auto const tempStatePath = std::filesystem::path(statePath) += c_replacingTempSuffix;
+        std::erase_if(files, [&](std::filesystem::path const& path) {
+            auto const normal = std::filesystem::absolute(path).lexically_normal();
+            return (normal == statePath) || (normal == tempStatePath);
+        });
+    }
+    auto const previousStamps = incremental ? LoadFileStamps(options.incrementalState) : FileStampMap{};
+
+    std::mutex resultLock;
+    VerifySummary summary;
+    FileStampMap cleanStamps;
+
+    auto const threadCount = options.threadCount ? options.threadCount : std::thread::hardware_concurrency();
+    ForEachParallel(std::span{ files }, threadCount, [&](std::filesystem::path const& path)
+        {
+            VerifyFileResult result{ .path = path };
+            std::wstring relative;
+            FileStamp stamp;
+            try
+            {
+                relative = path.lexically_relative(root).wstring();
+                stamp = GetFileStamp(path);
+
+                auto previous = previousStamps.find(relative);
+                if ((previous != previousStamps.end()) && (previous->second == stamp))
+                {
+                    result.status = VerifyStatus::Skipped;
+                    result.ciphertextSize = stamp.size;
+                }
+                else
+                {
+                    result = VerifyProtectedFile(path);
+                }
+            }
+            catch (...)
+            {
+                result.status = VerifyStatus::Failed;
+                result.error = wil::ResultFromCaughtException();
+            }
+
+            std::lock_guard lock(resultLock);
+            try
+            {
+                switch (result.status)
+                {
+                case VerifyStatus::Verified:
+                    ++summary.verified;
+                    summary.ciphertextBytes += result.ciphertextSize;
+                    summary.cleartextBytes += result.cleartextSize;
+                    break;
+                case VerifyStatus::Skipped:
+                    ++summary.skipped;
+                    break;
+                case VerifyStatus::Failed:
+                    ++summary.failed;
+                    break;
+                }
+
+                if (incremental && (result.status != VerifyStatus::Failed))
+                {
+                    cleanStamps.insert_or_assign(relative, stamp);
+                }
+
+                if (options.onResult)
+                {
+                    options.onResult(result);
+                }
+            }
+            CATCH_LOG();
+        });
+
+    if (incremental)
+    {
+        SaveFileStamps(options.incrementalState, cleanStamps);
+    }
+
+    summary.elapsed = std::chrono::steady_clock::now() - start;
+    return summary;
+}
@@ -0,0 +1,59 @@
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../LoadGenerator.h"
+
+// Runs the load generator against the stand-in backend on platforms without NCrypt. Takes the
+// same options as "DataProtectionManager2 loadgen", apart from --backend and --scope.
+
+namespace
+{
+    void PrintUsage()
+    {
+        std::cerr << "usage: loadgen-standin [--op protect|unprotect|stream] [--threads N] [--rate R] [--warmup S] [--duration S]\n"
+                     "                       [--size N | --size-uniform MIN MAX | --size-lognormal MEDIAN SIGMA MAX]\n"
+                     "                       [--output results.json]\n";
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> const args(argv + 1, argv + argc);
+    LoadGeneratorOptions options;
+    std::string outputPath;
+    for (size_t i = 0; i < args.size(); ++i)
+    {
+        if ((args[i] == "--output") && (i + 1 < args.size()))
+        {
+            outputPath = args[++i];
+        }
+        else if (!ParseLoadGeneratorOption(args, i, options))
+        {
+            PrintUsage();
+            return 2;
+        }
+    }
+
+    try
+    {
+        auto backend = CreateStandInLoadBackend();
+        auto const result = RunLoadGenerator(*backend, options);
+        if (outputPath.empty())
+        {
+            result.writeJson(std::cout);
+        }
+        else
+        {
+            std::ofstream output(outputPath, std::ios::trunc);
+            result.writeJson(output);
+        }
+        return result.errors ? 1 : 0;
+    }
+    catch (std::exception const& error)
+    {
+        std::cerr << "error: " << error.what() << "\n";
+        return 1;
+    }
+}